@@ -44,6 +44,8 @@ extern "C" {
 /* Includes ------------------------------------------------------------------*/
 #include <stdio.h>
 
+#include "sdkconfig.h"
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 
@@ -64,6 +66,89 @@ typedef struct {
 	led_mode_e mode;											/*!< LED working mode */
 } led_t;
 
+typedef enum {
+	LED_BLEND_OVER = 0,		/*!< Alpha-over, also takes the layer mode */
+	LED_BLEND_MAX,				/*!< Brightest of the layer and the layers below */
+	LED_BLEND_ADD,				/*!< Sum, saturated at full intensity */
+	LED_BLEND_MULTIPLY		/*!< Product, e.g. for a dimmer */
+} led_blend_e;
+
+typedef struct {
+	led_t * led;					/*!< LED instance to update */
+	led_mode_e mode;			/*!< New LED working mode */
+	uint8_t intensity;		/*!< New LED intensity between 0 and 100 */
+	uint32_t time;				/*!< New fade time in milliseconds */
+} led_cmd_t;
+
+typedef struct {
+	uint8_t max;						/*!< Intensity at the top of the fade */
+	uint8_t min;						/*!< Intensity at the bottom of the fade */
+	uint8_t end;						/*!< Intensity held after the last cycle */
+	uint32_t rise_time;			/*!< Rise time in milliseconds */
+	uint32_t fall_time;			/*!< Fall time in milliseconds */
+	uint32_t high_hold;			/*!< Hold time at the top in milliseconds */
+	uint32_t low_hold;			/*!< Hold time at the bottom in milliseconds */
+	uint32_t repeat;				/*!< Number of cycles, 0 to repeat forever */
+} led_fade_profile_t;
+
+typedef struct led_group_s {
+	uint32_t members;												/*!< LEDC channels of the members */
+	uint32_t phase[SOC_LEDC_CHANNEL_NUM];		/*!< Phase offset of each member in milliseconds */
+	led_mode_e mode;												/*!< Group working mode */
+	uint32_t duty;													/*!< Duty value when on */
+	uint32_t time;													/*!< Segment time in milliseconds */
+	int64_t start;													/*!< Timebase origin in microseconds */
+	uint32_t gen;														/*!< Generation of the parameters */
+	uint32_t applied;												/*!< Generation applied by the control task */
+	uint32_t owned;													/*!< Members driven by the group */
+	uint32_t segment[SOC_LEDC_CHANNEL_NUM];	/*!< Last segment started by each member */
+	bool due;																/*!< Group collected by the scheduler */
+	uint16_t slot;													/*!< Schedule heap index + 1 of the group entry, 0 if none */
+	struct led_group_s * next;							/*!< Next group collected by the scheduler */
+} led_group_t;
+
+#if CONFIG_LED_COLOR
+typedef struct {
+	led_t * leds[4];		/*!< Red, green, blue and optional white LED instances */
+	uint16_t gain[4];		/*!< White balance gain of each channel, 256 is unity */
+} led_color_t;
+#endif
+
+typedef struct {
+	gpio_num_t gpio;		/*!< GPIO driven by the LED */
+	uint8_t channel;		/*!< LEDC channel of the LED */
+	bool invert;				/*!< Invert the output, for active low LEDs */
+} led_board_t;
+
+#define LED_LATE_BUCKETS	16
+
+typedef struct {
+	uint32_t submitted;			/*!< Commands accepted by led_set_* */
+	uint32_t applied;				/*!< Outputs written to the LEDC peripheral, unchanged ones are skipped */
+	uint32_t coalesced;			/*!< Commands merged into one still pending */
+	uint32_t dropped;				/*!< Commands sent before the control task existed */
+	uint32_t fade_ends;			/*!< Fade end interrupts */
+	uint32_t stale;					/*!< Fade ends discarded after a mode change */
+	uint32_t driver_errors;	/*!< Failed LEDC driver calls */
+	uint32_t wakeups;				/*!< Control task wake-ups, all LEDs */
+	uint32_t wake_hwm;			/*!< Most events serviced in one wake-up, all LEDs */
+	uint32_t fade_time_us;	/*!< Achieved duration of the last fade, longest of all LEDs */
+	uint32_t fade_error_us;	/*!< Largest fade duration error, all LEDs if totals */
+	uint32_t load;					/*!< Committed load before the budget scale, all LEDs */
+	uint32_t headroom;			/*!< Power budget left at the committed load, all LEDs */
+	uint32_t late[LED_LATE_BUCKETS];	/*!< Scheduled commands late by less than 2^n us */
+} led_stats_t;
+
+#if CONFIG_LED_LATENCY_STATS
+#define LED_LATENCY_BUCKETS	16
+
+typedef struct {
+	uint32_t buckets[LED_LATENCY_BUCKETS];	/*!< Bucket n counts latencies below 2^n us */
+	uint32_t count;													/*!< Number of commands measured */
+	uint32_t max_us;												/*!< Worst latency measured in us */
+} led_latency_t;
+#endif
+
 /* Exported constants --------------------------------------------------------*/
 
 /* Exported macro ------------------------------------------------------------*/
@@ -83,6 +168,22 @@ typedef struct {
   */
 esp_err_t led_init(led_t * const me, gpio_num_t gpio);
 
+/**
+  * @brief Create several LED instances from a const board table, e.g. kept in
+  * flash. The whole table is validated before the peripheral is touched
+  *
+  * @param leds Array of n led_t structures
+  * @param board Array of n board entries, one per LED
+  * @param n Number of LEDs
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid, or a channel or GPIO
+  * 	of the table is invalid, repeated or already used
+  * 	- ESP_ERR_NO_MEM if there is not enough memory
+  */
+esp_err_t led_init_many(led_t * leds, const led_board_t * board, size_t n);
+
 /**
   * @brief Set LED instance mode to continuous
   *
@@ -107,9 +208,485 @@ esp_err_t led_set_continuous(led_t * const me, uint8_t intensity);
   * @retval
   * 	- ESP_OK on success
   * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NOT_SUPPORTED if CONFIG_LED_FADE is disabled
   */
 esp_err_t led_set_fade(led_t * const me, uint8_t intensity, uint32_t time);
 
+/**
+  * @brief Set LED instance mode to fade with a fade profile. The LED ramps
+  * from its current intensity to max, then cycles between max and min with
+  * the rise and fall times and holds of the profile. After a finite number of
+  * cycles it ramps to the end intensity and stays there
+  *
+  * @param me Pointer to led_t structure
+  * @param profile Pointer to the fade profile
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_INVALID_STATE if the control task was not created
+  * 	- ESP_ERR_NOT_SUPPORTED if CONFIG_LED_FADE is disabled
+  */
+esp_err_t led_set_fade_ex(led_t * const me,
+		const led_fade_profile_t * const profile);
+
+/**
+  * @brief Set LED instance mode to continuous from an interrupt service
+  * routine. It never blocks nor logs
+  *
+  * @param me Pointer to led_t structure
+  * @param intensity LED initial light intensity. Must be a value between 0 and
+  * 100.
+  * @param task_woken Set to pdTRUE if a context switch should be requested
+  * before the interrupt exits
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_INVALID_STATE if the control task was not created yet, the LED
+  * 	is left unchanged
+  */
+esp_err_t led_set_continuous_from_isr(led_t * const me, uint8_t intensity,
+		BaseType_t * const task_woken);
+
+/**
+  * @brief Set LED instance mode to fade from an interrupt service routine. It
+  * never blocks nor logs
+  *
+  * @param me Pointer to led_t structure
+  * @param intensity LED initial intensity. Must be a value between 0 and
+  * 100
+  * @param time Time in milliseconds to change the LED state between on and off
+  * @param task_woken Set to pdTRUE if a context switch should be requested
+  * before the interrupt exits
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_INVALID_STATE if the control task was not created yet, the LED
+  * 	is left unchanged
+  * 	- ESP_ERR_NOT_SUPPORTED if CONFIG_LED_FADE is disabled
+  */
+esp_err_t led_set_fade_from_isr(led_t * const me, uint8_t intensity,
+		uint32_t time, BaseType_t * const task_woken);
+
+/**
+  * @brief Update several LED instances at once. Every command is validated
+  * before any LED changes, and the control task is woken a single time for
+  * the whole batch. The new duties of continuous commands are staged first and
+  * latched together, so they take effect on the same PWM period
+  *
+  * @param cmds Array of commands. Only continuous and fade modes are
+  * supported, and the time is ignored in continuous mode
+  * @param n Number of commands in the array
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if any command is invalid, nothing is applied
+  * 	- ESP_ERR_INVALID_STATE if the control task was not created yet
+  * 	- ESP_ERR_NOT_SUPPORTED if a command fades and CONFIG_LED_FADE is
+  * 	disabled, nothing is applied
+  */
+esp_err_t led_set_many(const led_cmd_t * cmds, size_t n);
+
+/**
+  * @brief Apply a command at a given time. Pending commands are kept sorted
+  * by the control task, which sleeps until the next one is due
+  *
+  * @param cmd Command to apply. Only continuous and fade modes are supported
+  * @param time Time in microseconds, in the esp_timer_get_time() timebase, at
+  * which the command is applied. Times in the past are applied right away
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_FAIL if the control task could not be created
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NO_MEM if too many commands are already scheduled
+  * 	- ESP_ERR_NOT_SUPPORTED if the command fades and CONFIG_LED_FADE is
+  * 	disabled
+  */
+esp_err_t led_schedule(const led_cmd_t * cmd, int64_t time);
+
+/**
+  * @brief Set the content of a priority layer of a LED instance. The highest
+  * active layer drives the LED, and led_set_* drive the base layer below all
+  * of them. Lower layers keep their state and show again once the layers
+  * above are cleared or time out
+  *
+  * @param me Pointer to led_t structure
+  * @param layer Layer number, from 1 to CONFIG_LED_LAYER_NUM. Higher layers
+  * have higher priority
+  * @param mode Layer working mode. Only continuous and fade modes are
+  * supported
+  * @param intensity Layer intensity. Must be a value between 0 and 100
+  * @param time Fade time in milliseconds, ignored in continuous mode
+  * @param timeout Time in milliseconds after which the layer is cleared, or 0
+  * to keep it until led_layer_clear() is called
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_FAIL if the control task could not be created
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NO_MEM if the timeout could not be scheduled, the layer is
+  * 	set without a timeout
+  * 	- ESP_ERR_NOT_SUPPORTED if the layer fades and CONFIG_LED_FADE is
+  * 	disabled
+  */
+esp_err_t led_layer_set(led_t * const me, uint8_t layer, led_mode_e mode,
+		uint8_t intensity, uint32_t time, uint32_t timeout);
+
+/**
+  * @brief Set how a priority layer of a LED instance is composited over the
+  * layers below it. Layers are alpha-over and fully opaque by default. The
+  * mode and fade time of the LED come from the highest active alpha-over
+  * layer, the other blend modes only change its intensity
+  *
+  * @param me Pointer to led_t structure
+  * @param layer Layer number, from 1 to CONFIG_LED_LAYER_NUM
+  * @param blend Blend mode
+  * @param opacity Layer opacity, from 0 (invisible) to 255 (opaque)
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_layer_set_blend(led_t * const me, uint8_t layer,
+		led_blend_e blend, uint8_t opacity);
+
+/**
+  * @brief Set the master intensity that scales the output of every LED
+  * instance. LEDs whose output changes are re-flushed once and running fades
+  * are retargeted in hardware, the led_set_* and layer states are kept
+  *
+  * @param intensity Master intensity value, from 0 to 100
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_FAIL if the control task could not be created
+  */
+esp_err_t led_set_master(uint8_t intensity);
+
+/**
+  * @brief Set the power budget shared by all LED instances. When the
+  * committed load exceeds it, every LED output is scaled down proportionally
+  * until it fits. A fade counts with the peak of its profile
+  *
+  * @param budget Budget in the units of the LED weights, e.g. mA, or 0 to
+  * disable the limiter
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_FAIL if the control task could not be created
+  */
+esp_err_t led_set_budget(uint32_t budget);
+
+/**
+  * @brief Set the load of a LED instance at full intensity for the power
+  * budget
+  *
+  * @param me Pointer to led_t structure
+  * @param weight Load at full intensity, e.g. current in mA
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_FAIL if the control task could not be created
+  */
+esp_err_t led_set_weight(led_t * const me, uint16_t weight);
+
+/**
+  * @brief Clear a priority layer of a LED instance, restoring the highest
+  * layer below it
+  *
+  * @param me Pointer to led_t structure
+  * @param layer Layer number, from 1 to CONFIG_LED_LAYER_NUM
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_layer_clear(led_t * const me, uint8_t layer);
+
+/**
+  * @brief Define a LED group whose members share a single timebase. Each
+  * member is advanced by its phase offset, e.g. for chase effects. The group
+  * must not be running
+  *
+  * @param me Pointer to led_group_t structure
+  * @param leds Array of pointers to the member led_t structures
+  * @param phases Array of phase offsets in milliseconds, one per member, or
+  * NULL to keep the members in phase
+  * @param n Number of members
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_group_init(led_group_t * const me, led_t * const * leds,
+		const uint32_t * phases, size_t n);
+
+/**
+  * @brief Fade the members of a LED group up and down on the shared
+  * timebase. Reversals of all members are issued together and each ramp ends
+  * on the timebase, so the members never drift apart. A command to a member
+  * takes it out of the group
+  *
+  * @param me Pointer to led_group_t structure
+  * @param intensity Intensity at the top of the fade, from 0 to 100
+  * @param time Time in milliseconds of each ramp
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NO_MEM if the schedule is full
+  * 	- ESP_ERR_NOT_SUPPORTED if CONFIG_LED_FADE is disabled
+  */
+esp_err_t led_group_set_fade(led_group_t * const me, uint8_t intensity,
+		uint32_t time);
+
+/**
+  * @brief Blink the members of a LED group on the shared timebase
+  *
+  * @param me Pointer to led_group_t structure
+  * @param intensity Intensity when on, from 0 to 100
+  * @param time Time in milliseconds of each on and off period
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NO_MEM if the schedule is full
+  */
+esp_err_t led_group_set_blink(led_group_t * const me, uint8_t intensity,
+		uint32_t time);
+
+/**
+  * @brief Stop a LED group, its members go back to their own state
+  *
+  * @param me Pointer to led_group_t structure
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_NO_MEM if the schedule is full
+  */
+esp_err_t led_group_stop(led_group_t * const me);
+
+#if CONFIG_LED_COLOR
+/**
+  * @brief Create a color LED from three or four LED instances. Its channels
+  * are always updated together, on the same PWM period
+  *
+  * @param me Pointer to led_color_t structure
+  * @param red Pointer to the led_t structure of the red channel
+  * @param green Pointer to the led_t structure of the green channel
+  * @param blue Pointer to the led_t structure of the blue channel
+  * @param white Pointer to the led_t structure of the white channel, or NULL
+  * for a RGB LED
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_color_init(led_color_t * const me, led_t * const red,
+		led_t * const green, led_t * const blue, led_t * const white);
+
+/**
+  * @brief Set the white balance of a color LED
+  *
+  * @param me Pointer to led_color_t structure
+  * @param gain Gain of the red, green, blue and white channels, 256 is unity
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_color_set_balance(led_color_t * const me,
+		const uint16_t gain[4]);
+
+/**
+  * @brief Set a color LED to a RGB color. On a RGBW LED the part common to
+  * all colors is moved to the white channel
+  *
+  * @param me Pointer to led_color_t structure
+  * @param red Red component, from 0 to 255
+  * @param green Green component, from 0 to 255
+  * @param blue Blue component, from 0 to 255
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_color_set_rgb(led_color_t * const me, uint8_t red,
+		uint8_t green, uint8_t blue);
+
+/**
+  * @brief Set a color LED to a HSV color
+  *
+  * @param me Pointer to led_color_t structure
+  * @param hue Hue in degrees, from 0 to 359
+  * @param saturation Saturation, from 0 to 255
+  * @param value Value, from 0 to 255
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_color_set_hsv(led_color_t * const me, uint16_t hue,
+		uint8_t saturation, uint8_t value);
+
+/**
+  * @brief Set a color LED to the color of a black body
+  *
+  * @param me Pointer to led_color_t structure
+  * @param kelvin Color temperature in kelvin, clamped from 1000 to 10000
+  * @param intensity Intensity, from 0 to 100
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_color_set_temperature(led_color_t * const me, uint16_t kelvin,
+		uint8_t intensity);
+
+/**
+  * @brief Set a tunable white LED made of a warm and a cool white LED
+  * instance, whose color temperatures are CONFIG_LED_CCT_WARM and
+  * CONFIG_LED_CCT_COOL. The intensity is split between both channels so
+  * their sum, and so the lumen output, stays constant over the range
+  *
+  * @param warm Pointer to the led_t structure of the warm white channel
+  * @param cool Pointer to the led_t structure of the cool white channel
+  * @param kelvin Color temperature in kelvin, clamped to the channels range
+  * @param intensity Intensity, from 0 to 100
+  * @param time Time in milliseconds of a coordinated ramp of both channels
+  * from their current intensity, or 0 to change at once
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  * 	- ESP_ERR_INVALID_STATE if the control task was not created
+  * 	- ESP_ERR_NOT_SUPPORTED if time is not 0 and CONFIG_LED_FADE is disabled
+  */
+esp_err_t led_set_cct(led_t * const warm, led_t * const cool, uint16_t kelvin,
+		uint8_t intensity, uint32_t time);
+#endif
+
+/**
+  * @brief Apply again every LED instance, the master dimmer and the power
+  * budget from the state kept in RTC memory. Every change is written there as
+  * soon as it is made, so this re-applies the current state and never brings
+  * back an earlier one. led_init() already restores each instance after deep
+  * sleep or a soft reset
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_NOT_FOUND if neither the LEDs nor the master dimmer and the
+  * 	budget have a valid state
+  * 	- ESP_ERR_NOT_SUPPORTED if CONFIG_LED_RESTORE is disabled
+  */
+esp_err_t led_restore_all(void);
+
+/**
+  * @brief Get the current output intensity of a LED instance, including the
+  * master dimmer and the progress of a running fade. It is computed from the
+  * stored ramp, without locks, LEDC register reads or waking the control task
+  *
+  * @param me Pointer to led_t structure
+  * @param intensity Pointer to store the intensity value, from 0 to 100
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_get_brightness(led_t * const me, uint8_t * const intensity);
+
+/**
+  * @brief Get the energy accumulated by a LED instance as the time it would
+  * have been on at full intensity. The output duty is integrated
+  * analytically on every change, fades included
+  *
+  * @param me Pointer to led_t structure
+  * @param energy Pointer to store the full intensity equivalent time in
+  * microseconds
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_get_energy(led_t * const me, uint64_t * const energy);
+
+/**
+  * @brief Set the energy accumulated by a LED instance, e.g. to restore a
+  * value persisted with led_get_energy()
+  *
+  * @param me Pointer to led_t structure
+  * @param energy Full intensity equivalent time in microseconds
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_set_energy(led_t * const me, uint64_t energy);
+
+/**
+  * @brief Get the statistics counters of a LED instance or of the whole
+  * component
+  *
+  * @param me Pointer to led_t structure, or NULL to get the totals of all
+  * LEDs
+  * @param stats Pointer to led_stats_t structure to fill
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_get_stats(led_t * const me, led_stats_t * const stats);
+
+/**
+  * @brief Write the statistics of the whole component and of every LED
+  * instance as JSON, with the latency histograms if they are enabled, so a
+  * run can be compared against a saved baseline
+  *
+  * @param stream Stream to write the JSON document to
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_stats_dump(FILE * stream);
+
+#if CONFIG_LED_LATENCY_STATS
+/**
+  * @brief Get the command latency histogram of a LED instance. The latency is
+  * measured from the moment a command is submitted until the control task writes
+  * it to the LEDC peripheral
+  *
+  * @param me Pointer to led_t structure
+  * @param latency Pointer to led_latency_t structure to fill
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_get_latency(led_t * const me, led_latency_t * const latency);
+#endif
+
+#if CONFIG_LED_TRACE
+/**
+  * @brief Write the trace buffer as Chrome trace event JSON, ready to be
+  * opened in Perfetto or chrome://tracing. Events lost because the buffer
+  * wrapped are reported in otherData.overwritten
+  *
+  * @param stream Stream to write the JSON document to
+  *
+  * @retval
+  * 	- ESP_OK on success
+  * 	- ESP_ERR_INVALID_ARG if the argument is invalid
+  */
+esp_err_t led_trace_dump(FILE * stream);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
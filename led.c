@@ -34,13 +34,137 @@
   */
 
 /* Includes ------------------------------------------------------------------*/
+#include <stdatomic.h>
+#include <string.h>
+
 #include "led.h"
 #include "esp_log.h"
-#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+#if CONFIG_LED_RESTORE
+#include <stddef.h>
+
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#endif
 
 /* External variables --------------------------------------------------------*/
 
 /* Private typedef -----------------------------------------------------------*/
+typedef struct {
+	atomic_uint submitted;
+	atomic_uint applied;
+	atomic_uint coalesced;
+	atomic_uint dropped;
+	atomic_uint fade_ends;
+	atomic_uint stale;
+	atomic_uint driver_errors;
+	atomic_uint fade_time;
+	atomic_uint fade_error;
+} led_counters_t;
+
+typedef struct {
+	uint32_t floor;				/*!< Duty at the bottom of the fade */
+	uint32_t fall;				/*!< Fall time in milliseconds */
+	uint32_t hold_high;		/*!< Hold time at the top in microseconds */
+	uint32_t hold_low;		/*!< Hold time at the bottom in microseconds */
+	uint32_t repeat;			/*!< Number of cycles, 0 to repeat forever */
+	uint32_t end;					/*!< Duty held after the last cycle */
+} led_profile_t;
+
+typedef struct {
+	led_mode_e mode;				/*!< Working mode */
+	uint32_t duty;					/*!< Duty value, the top of a fade */
+	uint32_t time;					/*!< Fade rise time in milliseconds */
+	led_profile_t profile;	/*!< Rest of the fade profile */
+} led_output_t;
+
+typedef enum {
+	LED_FADE_RISE = 0,
+	LED_FADE_HOLD_HIGH,
+	LED_FADE_FALL,
+	LED_FADE_HOLD_LOW,
+	LED_FADE_FINISH,
+	LED_FADE_DONE
+} led_fade_step_e;
+
+typedef struct {
+	led_fade_step_e next;		/*!< Next step of the fade profile */
+	uint32_t left;					/*!< Cycles left, 0 when repeating forever */
+	uint32_t gen;						/*!< Generation, discards holds of older commands */
+} led_fade_t;
+
+typedef struct {
+	led_output_t output;			/*!< Layer content */
+	uint32_t gen;							/*!< Generation, discards timeouts of older contents */
+	led_blend_e blend;				/*!< Blend mode over the layers below */
+	uint16_t transparency;		/*!< 256 - opacity, so a zeroed layer is opaque */
+} led_layer_t;
+
+typedef struct {
+	uint16_t delta;				/*!< Duty delta of the fade */
+	uint16_t scale;				/*!< Duty step, 0 if the entry is empty */
+	uint32_t time;				/*!< Requested fade time in milliseconds */
+	uint16_t cycles;			/*!< PWM periods per step */
+	uint32_t achieved;		/*!< Achieved fade time in microseconds */
+} led_step_t;
+
+typedef struct {
+	uint32_t from;				/*!< Duty at the start of the ramp */
+	uint32_t to;					/*!< Duty at the end of the ramp */
+	int64_t start;				/*!< Start time of the ramp in microseconds */
+	uint32_t duration;		/*!< Ramp duration in microseconds */
+	int64_t slope;				/*!< Duty per microsecond in 32.32 fixed point */
+} led_ramp_t;
+
+typedef struct {
+	int64_t time;				/*!< Due time in microseconds */
+	led_cmd_t cmd;			/*!< Command to apply */
+	uint8_t layer;			/*!< Layer to expire, or 0 to apply the command */
+	bool hold;					/*!< Fade hold to end instead of a command */
+	led_group_t * group;	/*!< Group to advance instead of a command */
+	uint32_t gen;				/*!< Generation of the layer, fade or group */
+} led_sched_entry_t;
+
+#if CONFIG_LED_RESTORE
+typedef struct {
+	uint32_t magic;					/*!< LED_PERSIST_MAGIC when written */
+	led_mode_e mode;				/*!< Working mode */
+	uint32_t duty;					/*!< Duty value */
+	uint32_t time;					/*!< Fade rise time in milliseconds */
+	led_profile_t profile;	/*!< Rest of the fade profile */
+	uint32_t crc;						/*!< CRC of the fields above */
+} led_persist_t;
+
+typedef struct {
+	uint32_t magic;					/*!< LED_PERSIST_MAGIC when written */
+	uint8_t master;					/*!< Master dimmer, from 0 to 100 */
+	uint32_t budget;				/*!< Power budget, 0 if disabled */
+	uint32_t budget_scale;	/*!< Budget scale in 1/256 */
+	uint16_t weights[SOC_LEDC_CHANNEL_NUM];	/*!< Load of each LED at full intensity */
+	uint32_t crc;						/*!< CRC of the fields above */
+} led_persist_global_t;
+#endif
+
+#if CONFIG_LED_TRACE
+typedef enum {
+	LED_TRACE_ENQUEUE = 0,
+	LED_TRACE_DEQUEUE,
+	LED_TRACE_FADE_START,
+	LED_TRACE_FADE_END,
+	LED_TRACE_MODE_CHANGE,
+	LED_TRACE_EVENT_NUM
+} led_trace_event_e;
+
+typedef struct {
+	atomic_uint seq;		/*!< Sequence number + 1 of the event, 0 while written */
+	int64_t ts;					/*!< Event timestamp in microseconds */
+	uint8_t event;			/*!< Event type */
+	uint8_t channel;		/*!< LEDC channel of the LED */
+} led_trace_record_t;
+#endif
 
 /* Private macro -------------------------------------------------------------*/
 #if CONFIG_IDF_TARGET_ESP32
@@ -55,15 +179,255 @@
 #define LED_TIMER_FREQ	CONFIG_LED_TIMER_FREQ
 #define LED_TIMER_NUM		CONFIG_LED_TIMER_NUM
 
+#define LED_SCHED_DEPTH	CONFIG_LED_SCHEDULE_DEPTH
+#define LED_LAYER_NUM		CONFIG_LED_LAYER_NUM
+#define LED_DUTY_RESOLUTION	LEDC_TIMER_13_BIT
+#define LED_DUTY_INTENSITY	((1 << LED_DUTY_RESOLUTION) / 100)
+#define LED_DUTY_FULL				(100 * LED_DUTY_INTENSITY)
+
+#if CONFIG_LED_FADE
+#define LED_FADE_ENABLED		1
+#else
+#define LED_FADE_ENABLED		0
+#endif
+
+#if CONFIG_LED_COLOR
+#define LED_KELVIN_MIN			1000
+#define LED_KELVIN_MAX			10000
+#define LED_KELVIN_STEP			500
+
+#define LED_CCT_WARM				CONFIG_LED_CCT_WARM
+#define LED_CCT_COOL				CONFIG_LED_CCT_COOL
+#define LED_CCT_STEPS				32
+
+/* Cool share of the duty at step i of the range, linear in mired so equal
+ * steps look equally apart, while warm + cool keeps the lumen constant */
+#define LED_CCT_MIRED(k)		(1000000 / (k))
+#define LED_CCT_KELVIN(i)		(LED_CCT_WARM + \
+		(LED_CCT_COOL - LED_CCT_WARM) * (i) / LED_CCT_STEPS)
+#define LED_CCT_MIX(i)			(LED_DUTY_FULL * \
+		(LED_CCT_MIRED(LED_CCT_WARM) - LED_CCT_MIRED(LED_CCT_KELVIN(i))) / \
+		(LED_CCT_MIRED(LED_CCT_WARM) - LED_CCT_MIRED(LED_CCT_COOL)))
+#endif
+
+#define LED_PERSIST_MAGIC		0x4c454432	/*!< "LED2" */
+
+#define LED_STEP_CACHE_NUM	16
+#define LED_STEP_MAX				1023	/*!< Largest LEDC scale, cycle and step number */
+
+/* Control task notification bits, a command and a fade end bit per LED */
+#define LED_EVENT_COMMAND(channel)	(1UL << (channel))
+#define LED_EVENT_FADE_END(channel)	(1UL << ((channel) + 16))
+#define LED_EVENT_SCHEDULE					(1UL << 31)
+#define LED_EVENT_LEDS							((1UL << LED_MAX_NUM) - 1)
+
+_Static_assert(LED_MAX_NUM <= 15, "LED events must fit in a notification");
+_Static_assert(GPIO_NUM_MAX <= 64, "GPIOs must fit in the board table mask");
+
+#if CONFIG_LED_DIRECT_APPLY
+#define LED_LOCK(channel)		xSemaphoreTake(led_lock[channel], portMAX_DELAY)
+#define LED_UNLOCK(channel)	xSemaphoreGive(led_lock[channel])
+#else
+#define LED_LOCK(channel)
+#define LED_UNLOCK(channel)
+#endif
+
+#define LED_STATS_INC(channel, counter)	\
+		atomic_fetch_add_explicit(&led_counters[channel].counter, 1, \
+				memory_order_relaxed)
+
+#if CONFIG_LED_LATENCY_STATS
+#define LED_LATENCY_STAMP(led)	led_latency_stamp(led)
+#define LED_LATENCY_RECORD(led)	led_latency_record(led)
+#else
+#define LED_LATENCY_STAMP(led)
+#define LED_LATENCY_RECORD(led)
+#endif
+
+#if CONFIG_LED_TRACE
+#define LED_TRACE_DEPTH	CONFIG_LED_TRACE_DEPTH
+#define LED_TRACE(event, channel)	led_trace(event, channel)
+
+_Static_assert((LED_TRACE_DEPTH & (LED_TRACE_DEPTH - 1)) == 0,
+		"CONFIG_LED_TRACE_DEPTH must be a power of two");
+#else
+#define LED_TRACE(event, channel)
+#endif
+
 /* Private function prototypes -----------------------------------------------*/
+static esp_err_t led_setup(led_t * const me, gpio_num_t gpio,
+		uint8_t channel, bool invert, uint32_t * const restored);
+static esp_err_t led_start(uint32_t restored);
+#if CONFIG_LED_FADE
 static bool fade_end_cb(const ledc_cb_param_t * param, void * arg);
+static esp_err_t led_fade_install(void);
+static void led_fade_register(led_t * const me);
+#endif
 static void led_control_task(void * arg);
+static esp_err_t led_control_start(void);
+static esp_err_t led_fade_ready(void);
+static uint32_t led_update(led_t * const led);
+static void led_compose(led_t * const led, led_output_t * const out);
+static uint32_t led_apply(led_t * const led, const led_output_t * out);
+#if CONFIG_LED_FADE
+static void led_fade_next(led_t * const led, const led_output_t * out,
+		uint32_t duty, int64_t now);
+static void led_fade_ramp(led_t * const led, uint32_t from, uint32_t to,
+		uint32_t time, int64_t now);
+static esp_err_t led_fade_stop(led_t * const led);
+static void led_fade_rescale(led_t * const led, const led_output_t * out,
+		int64_t now);
+static const led_step_t * led_fade_steps(uint32_t delta, uint32_t time);
+#endif
+static void led_latch(uint32_t channels);
+static void led_budget_commit(uint8_t channel, uint32_t peak);
+static uint32_t led_budget_update(void);
+static uint32_t led_ramp_duty(const led_ramp_t * ramp, int64_t now);
+static void led_ramp_store(uint8_t channel, const led_ramp_t * ramp);
+static uint64_t led_ramp_area(const led_ramp_t * ramp, int64_t from,
+		int64_t to);
+#if CONFIG_LED_DIRECT_APPLY
+static esp_err_t led_apply_direct_many(const led_cmd_t * cmds,
+		const uint32_t * duties, size_t n);
+#endif
+static esp_err_t led_set_many_duty(const led_cmd_t * cmds,
+		const uint32_t * duties, size_t n);
+static void led_store(led_t * const me, led_mode_e mode, uint32_t duty,
+		uint32_t time);
+static esp_err_t led_submit(uint32_t commands, bool from_isr,
+		BaseType_t * const task_woken);
+static void led_stats_hwm(unsigned events);
+static uint32_t led_bucket(uint32_t value, uint32_t buckets);
+static bool led_cmd_check(const led_cmd_t * cmd);
+static void led_stats_json(FILE * stream, const led_stats_t * stats);
+static esp_err_t led_sched_push(const led_sched_entry_t * entry);
+static void led_sched_cancel(const led_sched_entry_t * entry);
+static uint16_t * led_sched_slot(const led_sched_entry_t * entry);
+static size_t led_sched_sift(size_t i, const led_sched_entry_t * entry);
+static void led_sched_cb(void * arg);
+static uint32_t led_sched_run(void);
+static uint32_t led_group_tick(led_group_t * const group, int64_t now);
+static uint32_t led_group_step(led_t * const led, led_mode_e mode,
+		uint32_t target, int64_t end, int64_t now);
+static esp_err_t led_group_submit(led_group_t * const me, led_mode_e mode,
+		uint8_t intensity, uint32_t time);
+#if CONFIG_LED_COLOR
+static esp_err_t led_color_apply(led_color_t * const me, uint8_t red,
+		uint8_t green, uint8_t blue, uint8_t intensity);
+#endif
+#if CONFIG_LED_LATENCY_STATS
+static uint32_t led_latency_now(void);
+static void led_latency_stamp(led_t * const me);
+static void led_latency_record(led_t * const me);
+#endif
+#if CONFIG_LED_TRACE
+static void led_trace(led_trace_event_e event, uint32_t channel);
+#endif
+#if CONFIG_LED_RESTORE
+static void led_persist_save(led_t * const me);
+static bool led_persist_load(led_t * const me);
+static void led_persist_save_global(void);
+static bool led_persist_load_global(void);
+#endif
 
 /* Private variables ---------------------------------------------------------*/
 static const char * TAG = "led";
 static uint8_t led_num = 0;
 static TaskHandle_t led_control_handle = NULL;
-static QueueHandle_t led_control_queue = NULL;
+static led_t * led_instances[LED_MAX_NUM];
+static led_counters_t led_counters[LED_MAX_NUM];
+static atomic_uint led_wakeups;
+static atomic_uint led_wake_hwm;
+static atomic_uint led_restart;
+static portMUX_TYPE led_latch_lock = portMUX_INITIALIZER_UNLOCKED;
+static led_sched_entry_t led_sched_heap[LED_SCHED_DEPTH];
+static size_t led_sched_num = 0;
+static esp_timer_handle_t led_sched_timer = NULL;
+static portMUX_TYPE led_sched_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool led_sched_busy = false;
+static uint16_t led_sched_layer_slot[LED_MAX_NUM][LED_LAYER_NUM];
+static uint16_t led_sched_hold_slot[LED_MAX_NUM];
+static uint32_t led_sched_late[LED_LATE_BUCKETS];
+static led_output_t led_outputs[LED_MAX_NUM];
+static led_ramp_t led_ramps[LED_MAX_NUM];
+static led_profile_t led_profiles[LED_MAX_NUM];
+static led_fade_t led_fades[LED_MAX_NUM];
+#if CONFIG_LED_FADE
+static led_step_t led_step_cache[LED_STEP_CACHE_NUM];
+static atomic_bool led_fade_installed;
+static bool led_fade_active[LED_MAX_NUM];
+static uint32_t led_fade_ends[LED_MAX_NUM];
+#endif
+static atomic_uint led_ramp_seq[LED_MAX_NUM];
+#if CONFIG_LED_RESTORE
+static RTC_NOINIT_ATTR led_persist_t led_persist[LED_MAX_NUM];
+static RTC_NOINIT_ATTR led_persist_global_t led_persist_global;
+static portMUX_TYPE led_persist_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+static portMUX_TYPE led_ramp_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t led_energy[LED_MAX_NUM];
+static int64_t led_energy_ts[LED_MAX_NUM];
+static led_group_t * led_group_of[LED_MAX_NUM];
+
+#if CONFIG_LED_COLOR
+/* Black body color from LED_KELVIN_MIN to LED_KELVIN_MAX every LED_KELVIN_STEP */
+static const uint8_t led_kelvin_rgb[][3] = {
+		{255, 56, 0}, {255, 109, 0}, {255, 137, 18}, {255, 161, 72},
+		{255, 180, 107}, {255, 196, 137}, {255, 209, 163}, {255, 219, 186},
+		{255, 228, 206}, {255, 236, 224}, {255, 243, 239}, {255, 249, 253},
+		{245, 243, 255}, {235, 238, 255}, {227, 233, 255}, {220, 229, 255},
+		{214, 225, 255}, {208, 222, 255}, {204, 219, 255}
+};
+
+/* Mixing table for the configured duty resolution and white channels */
+static const uint16_t led_cct_mix[LED_CCT_STEPS + 1] = {
+		LED_CCT_MIX(0), LED_CCT_MIX(1), LED_CCT_MIX(2), LED_CCT_MIX(3),
+		LED_CCT_MIX(4), LED_CCT_MIX(5), LED_CCT_MIX(6), LED_CCT_MIX(7),
+		LED_CCT_MIX(8), LED_CCT_MIX(9), LED_CCT_MIX(10), LED_CCT_MIX(11),
+		LED_CCT_MIX(12), LED_CCT_MIX(13), LED_CCT_MIX(14), LED_CCT_MIX(15),
+		LED_CCT_MIX(16), LED_CCT_MIX(17), LED_CCT_MIX(18), LED_CCT_MIX(19),
+		LED_CCT_MIX(20), LED_CCT_MIX(21), LED_CCT_MIX(22), LED_CCT_MIX(23),
+		LED_CCT_MIX(24), LED_CCT_MIX(25), LED_CCT_MIX(26), LED_CCT_MIX(27),
+		LED_CCT_MIX(28), LED_CCT_MIX(29), LED_CCT_MIX(30), LED_CCT_MIX(31),
+		LED_CCT_MIX(32)
+};
+
+_Static_assert(LED_CCT_COOL > LED_CCT_WARM,
+		"Cool white must have a higher color temperature than warm white");
+
+_Static_assert(sizeof(led_kelvin_rgb) / sizeof(led_kelvin_rgb[0]) ==
+		(LED_KELVIN_MAX - LED_KELVIN_MIN) / LED_KELVIN_STEP + 1,
+		"Color temperature table does not match its range");
+#endif
+static portMUX_TYPE led_group_lock = portMUX_INITIALIZER_UNLOCKED;
+static led_layer_t led_layers[LED_MAX_NUM][LED_LAYER_NUM];
+static uint32_t led_layer_mask[LED_MAX_NUM];
+static portMUX_TYPE led_layer_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile uint8_t led_master = 100;
+static volatile uint32_t led_budget = 0;
+static uint16_t led_weights[LED_MAX_NUM];
+static uint32_t led_loads[LED_MAX_NUM];
+static atomic_uint led_load;
+static volatile uint32_t led_budget_scale = 256;
+#if CONFIG_LED_DIRECT_APPLY
+static SemaphoreHandle_t led_lock[LED_MAX_NUM];
+static SemaphoreHandle_t led_start_lock = NULL;
+#endif
+#if CONFIG_LED_LATENCY_STATS
+static uint32_t led_latency_ts[LED_MAX_NUM];
+static led_latency_t led_latency[LED_MAX_NUM];
+#endif
+#if CONFIG_LED_TRACE
+static led_trace_record_t led_trace_buf[LED_TRACE_DEPTH];
+static atomic_uint led_trace_head;
+static const char * const led_trace_names[LED_TRACE_EVENT_NUM] = {
+		"enqueue",
+		"dequeue",
+		"fade",
+		"fade",
+		"mode change"
+};
+#endif
 
 /* Exported functions --------------------------------------------------------*/
 esp_err_t led_init(led_t * const me, gpio_num_t gpio) {
@@ -71,6 +435,8 @@ esp_err_t led_init(led_t * const me, gpio_num_t gpio) {
 
 	/* Error code variable */
 	esp_err_t ret;
+	uint32_t restored = 0;
+	uint8_t channel = 0;
 
 	/* Check if the maximum number of LEDs was reached */
 	if(led_num >= LED_MAX_NUM) {
@@ -79,220 +445,2717 @@ esp_err_t led_init(led_t * const me, gpio_num_t gpio) {
 		return ESP_FAIL;
 	}
 
-	/* Configure and initialize timer for the first instance */
-	if(!led_num) {
-		ledc_timer_config_t leds_timer = {
-				.duty_resolution = LEDC_TIMER_13_BIT,
-				.freq_hz = LED_TIMER_FREQ,
-				.speed_mode = LED_SPEED_MODE,
-				.timer_num = LED_TIMER_NUM,
-				.clk_cfg = LEDC_AUTO_CLK,
-		};
+	/* Take the lowest channel not used by a board table */
+	while(led_instances[channel] != NULL) {
+		channel++;
+	}
 
-		ret = ledc_timer_config(&leds_timer);
+	ret = led_setup(me, gpio, channel, false, &restored);
 
-		if(ret != ESP_OK) {
-			ESP_LOGE(TAG, "Failed to configure timer");
+	if(ret != ESP_OK) {
+		return ret;
+	}
 
-			return ret;
+	return led_start(restored);
+}
+
+esp_err_t led_init_many(led_t * leds, const led_board_t * board, size_t n) {
+	uint32_t channels = 0;
+	uint64_t gpios = 0;
+	uint32_t restored = 0;
+
+	/* Validate the whole table before touching the peripheral */
+	if(leds == NULL || board == NULL || n == 0 || led_num + n > LED_MAX_NUM) {
+		ESP_LOGE(TAG, "Error in board arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Two channels routed to one pin would fight over it */
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] != NULL) {
+			gpios |= 1ULL << led_instances[i]->ledc_config->gpio_num;
 		}
 	}
 
-	/* Allocate memory for led instance */
-	me->ledc_config = malloc(sizeof(ledc_channel_config_t));
+	for(size_t i = 0; i < n; i++) {
+		if(board[i].channel >= LED_MAX_NUM ||
+				led_instances[board[i].channel] != NULL ||
+				(channels & (1UL << board[i].channel)) ||
+				!GPIO_IS_VALID_OUTPUT_GPIO(board[i].gpio) ||
+				(gpios & (1ULL << board[i].gpio))) {
+			ESP_LOGE(TAG, "Error in board entry %u", (unsigned)i);
 
-	if(me->ledc_config == NULL) {
-		ESP_LOGE(TAG, "Error to allocate memory for LEDC configuration");
+			return ESP_ERR_INVALID_ARG;
+		}
 
-		return ESP_ERR_NO_MEM;
+		channels |= 1UL << board[i].channel;
+		gpios |= 1ULL << board[i].gpio;
 	}
 
-	/* Fill data structure */
-	me->ledc_config->channel = led_num;
-	me->ledc_config->duty = 0;
-	me->ledc_config->gpio_num = gpio;
-	me->ledc_config->speed_mode = LED_SPEED_MODE;
-	me->ledc_config->hpoint = 0;
-	me->ledc_config->timer_sel = LED_TIMER_NUM;
-	me->ledc_config->flags.output_invert = 0;
-	me->ledc_config->intr_type = LEDC_INTR_DISABLE;
-
-	/* Set LED controller with its configuration */
-	ledc_channel_config(me->ledc_config);
+	ESP_LOGI(TAG, "Initializing %u LEDs...", (unsigned)n);
 
-	/* Install fade functionality for the first instance */
-	if(!led_num) {
-		ret = ledc_fade_func_install(0);
+	/* The first entry also sets up the timer and the fade service */
+	for(size_t i = 0; i < n; i++) {
+		esp_err_t ret = led_setup(&leds[i], board[i].gpio, board[i].channel,
+				board[i].invert, &restored);
 
 		if(ret != ESP_OK) {
 			return ret;
 		}
 	}
 
-	/* Register fade callback */
-	ledc_cbs_t callback = {
-			.fade_cb = fade_end_cb
+	return led_start(restored);
+}
+
+esp_err_t led_set_continuous(led_t * const me, uint8_t intensity) {
+	/* Check the new intensity value */
+	if(intensity > 100) {
+		ESP_LOGE(TAG, "Error in intensity argument");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+#if CONFIG_LED_DIRECT_APPLY
+	/* Update the duty in the caller's context */
+	led_cmd_t cmd = {
+			.led = me,
+			.mode = CONTINUOUS_MODE,
+			.intensity = intensity
 	};
 
-	ledc_cb_register(me->ledc_config->speed_mode,
-			me->ledc_config->channel,
-			&callback,
-			(void *)me);
+	return led_apply_direct_many(&cmd, NULL, 1);
+#else
+	/* Set mode and duty value */
+	led_store(me, CONTINUOUS_MODE, intensity * LED_DUTY_INTENSITY, me->time);
 
-	/* Initialize other variables */
-	me->time = 0;
-	me->state = 0;
-	me->mode = CONTINUOUS_MODE;
+	/* Notify the control task */
+	return led_submit(LED_EVENT_COMMAND(me->ledc_config->channel), false, NULL);
+#endif
+}
 
-	/* Increment the LED counter */
-	led_num++;
+esp_err_t led_set_fade(led_t * const me, uint8_t intensity, uint32_t time) {
+	/* Check the new intensity value */
+	if(intensity > 100) {
+		ESP_LOGE(TAG, "Error in intensity argument");
 
-	/* Create queue to send data to control LEDs */
-	if(led_control_queue == NULL) {
-		led_control_queue = xQueueCreate(LED_MAX_NUM * 2, sizeof(led_t *));
+		return ESP_ERR_INVALID_ARG;
+	}
 
-		if(led_control_queue == NULL) {
-			ESP_LOGE(TAG, "Failed to create queue");
+	/* Fades need the fade engine and the control task */
+	esp_err_t ret = led_fade_ready();
 
-			return ESP_FAIL;
-		}
+	if(ret != ESP_OK) {
+		return ret;
 	}
 
-	/* Create task to control LEDs */
-	if(led_control_handle == NULL) {
-		xTaskCreate(led_control_task,
-				"LED control task",
-				configMINIMAL_STACK_SIZE * 4,
-				NULL,
-				tskIDLE_PRIORITY + 1,
-				&led_control_handle);
+	/* Set mode, duty and time values */
+	led_store(me, FADE_MODE, intensity * LED_DUTY_INTENSITY, time);
 
-		if(led_control_handle == NULL) {
-			ESP_LOGE(TAG, "Failed to create task");
+	/* Notify the control task */
+	return led_submit(LED_EVENT_COMMAND(me->ledc_config->channel), false, NULL);
+}
 
-			return ESP_FAIL;
-		}
+esp_err_t led_set_fade_ex(led_t * const me,
+		const led_fade_profile_t * const profile) {
+	/* Check the profile values */
+	if(me == NULL || me->ledc_config == NULL || profile == NULL ||
+			profile->max > 100 || profile->min > profile->max ||
+			profile->end > 100) {
+		ESP_LOGE(TAG, "Error in fade profile arguments");
+
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	/* Return ESP_OK if successful */
-	return ESP_OK;
+	/* Fades need the fade engine and the control task */
+	esp_err_t ret = led_fade_ready();
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	/* Set mode, top duty and rise time, then precompute the rest once */
+	led_store(me, FADE_MODE, profile->max * LED_DUTY_INTENSITY,
+			profile->rise_time);
+
+	led_profiles[me->ledc_config->channel] = (led_profile_t){
+			.floor = profile->min * LED_DUTY_INTENSITY,
+			.fall = profile->fall_time,
+			.hold_high = profile->high_hold * 1000,
+			.hold_low = profile->low_hold * 1000,
+			.repeat = profile->repeat,
+			.end = profile->end * LED_DUTY_INTENSITY
+	};
+
+	/* Notify the control task */
+	return led_submit(LED_EVENT_COMMAND(me->ledc_config->channel), false, NULL);
 }
 
-esp_err_t led_set_continuous(led_t * const me, uint8_t intensity) {
-	/* Set mode */
-	me->mode = CONTINUOUS_MODE;
+esp_err_t IRAM_ATTR led_set_continuous_from_isr(led_t * const me,
+		uint8_t intensity, BaseType_t * const task_woken) {
+	/* Never log from an interrupt, only report the error */
+	if(intensity > 100) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* A rejected command must not be left in the state for a later flush */
+	if(led_control_handle == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
 
-	/* Set duty value according the new intensity value*/
+	led_store(me, CONTINUOUS_MODE, intensity * LED_DUTY_INTENSITY, me->time);
+
+	return led_submit(LED_EVENT_COMMAND(me->ledc_config->channel), true,
+			task_woken);
+}
+
+esp_err_t IRAM_ATTR led_set_fade_from_isr(led_t * const me, uint8_t intensity,
+		uint32_t time, BaseType_t * const task_woken) {
+	/* Never log from an interrupt, only report the error */
 	if(intensity > 100) {
-		ESP_LOGE(TAG, "Error in intensity argument");
+		return ESP_ERR_INVALID_ARG;
+	}
+
+#if !CONFIG_LED_FADE
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+
+	/* A rejected command must not be left in the state for a later flush */
+	if(led_control_handle == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	led_store(me, FADE_MODE, intensity * LED_DUTY_INTENSITY, time);
+
+	return led_submit(LED_EVENT_COMMAND(me->ledc_config->channel), true,
+			task_woken);
+}
+
+esp_err_t led_set_many(const led_cmd_t * cmds, size_t n) {
+	return led_set_many_duty(cmds, NULL, n);
+}
+
+esp_err_t led_schedule(const led_cmd_t * cmd, int64_t time) {
+	if(cmd == NULL || !led_cmd_check(cmd)) {
+		ESP_LOGE(TAG, "Error in scheduled command");
 
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	me->ledc_config->duty = intensity * 81;
+	/* Scheduled commands are always applied by the control task */
+	esp_err_t ret = cmd->mode == FADE_MODE? led_fade_ready() : ESP_OK;
 
-	/* Send to queue */
-	if(xQueueSend(led_control_queue, &me, 0) != pdPASS) {
-		ESP_LOGE(TAG, "Failed to send to queue");
+	if(ret == ESP_OK) {
+		ret = led_control_start();
+	}
 
-		return ESP_FAIL;
+	if(ret != ESP_OK) {
+		return ret;
 	}
 
-	return ESP_OK;
+	led_sched_entry_t entry = {
+			.time = time,
+			.cmd = *cmd,
+			.layer = 0
+	};
+
+	ret = led_sched_push(&entry);
+
+	if(ret == ESP_OK) {
+		LED_STATS_INC(cmd->led->ledc_config->channel, submitted);
+	}
+
+	return ret;
 }
-esp_err_t led_set_fade(led_t * const me, uint8_t intensity, uint32_t time) {
-	/* Set mode */
-	me->mode = FADE_MODE;
 
-	/* Set duty value according the new intensity value*/
+esp_err_t led_layer_set(led_t * const me, uint8_t layer, led_mode_e mode,
+		uint8_t intensity, uint32_t time, uint32_t timeout) {
+	led_cmd_t cmd = {
+			.led = me,
+			.mode = mode,
+			.intensity = intensity,
+			.time = time
+	};
+
+	if(layer == 0 || layer > LED_LAYER_NUM || !led_cmd_check(&cmd)) {
+		ESP_LOGE(TAG, "Error in layer arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Layers are always resolved by the control task */
+	esp_err_t ret = mode == FADE_MODE? led_fade_ready() : ESP_OK;
+
+	if(ret == ESP_OK) {
+		ret = led_control_start();
+	}
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	uint8_t channel = me->ledc_config->channel;
+	led_layer_t * l = &led_layers[channel][layer - 1];
+	led_sched_entry_t entry = {
+			.time = esp_timer_get_time() + (int64_t)timeout * 1000,
+			.cmd = cmd,
+			.layer = layer
+	};
+
+	/* Replace the layer content */
+	portENTER_CRITICAL(&led_layer_lock);
+
+	l->output.mode = mode;
+	l->output.duty = intensity * LED_DUTY_INTENSITY;
+	l->output.time = time;
+	l->output.profile = (led_profile_t){
+			.fall = time
+	};
+	entry.gen = ++l->gen;
+	led_layer_mask[channel] |= 1UL << (layer - 1);
+	atomic_fetch_or_explicit(&led_restart, 1UL << channel, memory_order_relaxed);
+
+	portEXIT_CRITICAL(&led_layer_lock);
+
+	/* Restore the layers below when the timeout expires. If the schedule is
+	 * full the layer stays without a timeout */
+	if(timeout) {
+		ret = led_sched_push(&entry);
+	}
+	else {
+		led_sched_cancel(&entry);
+	}
+
+	esp_err_t err = led_submit(LED_EVENT_COMMAND(channel), false, NULL);
+
+	return ret != ESP_OK? ret : err;
+}
+
+esp_err_t led_layer_set_blend(led_t * const me, uint8_t layer,
+		led_blend_e blend, uint8_t opacity) {
+	if(me == NULL || me->ledc_config == NULL || layer == 0 ||
+			layer > LED_LAYER_NUM || blend > LED_BLEND_MULTIPLY) {
+		ESP_LOGE(TAG, "Error in layer arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	uint8_t channel = me->ledc_config->channel;
+	led_layer_t * l = &led_layers[channel][layer - 1];
+	bool active;
+
+	/* Map opacity 255 to 256 so a fully opaque layer is exact */
+	portENTER_CRITICAL(&led_layer_lock);
+
+	l->blend = blend;
+	l->transparency = 256 - (opacity + (opacity >> 7));
+	active = led_layer_mask[channel] & (1UL << (layer - 1));
+
+	portEXIT_CRITICAL(&led_layer_lock);
+
+	/* Only an active layer changes the output */
+	return active? led_submit(LED_EVENT_COMMAND(channel), false, NULL) : ESP_OK;
+}
+
+esp_err_t led_set_master(uint8_t intensity) {
+	uint32_t commands = 0;
+
+	/* Check the new intensity value */
 	if(intensity > 100) {
 		ESP_LOGE(TAG, "Error in intensity argument");
 
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	me->ledc_config->duty = intensity * 81;
+	/* The master scale is always flushed by the control task */
+	esp_err_t ret = led_control_start();
 
-	/* Set new time value */
-	me->time = time;
+	if(ret != ESP_OK) {
+		return ret;
+	}
 
-	/* Send to queue */
-	if(xQueueSend(led_control_queue, &me, 0) != pdPASS) {
-		ESP_LOGE(TAG, "Failed to send to queue");
+	led_master = intensity;
 
-		return ESP_FAIL;
+#if CONFIG_LED_RESTORE
+	led_persist_save_global();
+#endif
+
+	/* Re-flush every LED once, the ones whose output keeps the same duty are
+	 * skipped by the control task */
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		/* Grouped LEDs take it on their next segment instead */
+		if(led_instances[i] != NULL && led_group_of[i] == NULL) {
+			commands |= LED_EVENT_COMMAND(i);
+		}
+	}
+
+	if(commands) {
+		xTaskNotify(led_control_handle, commands, eSetBits);
 	}
 
 	return ESP_OK;
 }
 
-/* Private functions ---------------------------------------------------------*/
-static bool fade_end_cb(const ledc_cb_param_t * param, void * arg) {
-    portBASE_TYPE task_awoken = pdFALSE;
+esp_err_t led_set_budget(uint32_t budget) {
+	uint32_t commands = 0;
 
-    if(param->event == LEDC_FADE_END_EVT) {
-    	xQueueSendFromISR(led_control_queue, &arg, 0);
-    }
+	/* The budget is always enforced by the control task */
+	esp_err_t ret = led_control_start();
 
-    return (task_awoken == pdTRUE);
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	led_budget = budget;
+
+#if CONFIG_LED_RESTORE
+	led_persist_save_global();
+#endif
+
+	/* Wake the control task to recompute the scale */
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] != NULL && led_group_of[i] == NULL) {
+			commands |= LED_EVENT_COMMAND(i);
+		}
+	}
+
+	if(commands) {
+		xTaskNotify(led_control_handle, commands, eSetBits);
+	}
+
+	return ESP_OK;
 }
 
-static void led_control_task(void * arg) {
-	/* Declare led instance pointer */
-	led_t * led;
+esp_err_t led_set_weight(led_t * const me, uint16_t weight) {
+	if(me == NULL || me->ledc_config == NULL) {
+		ESP_LOGE(TAG, "Error in weight arguments");
 
-	/* Inifinite loop */
-	for(;;) {
-		/* Try to read the queue */
-		if(xQueueReceive(led_control_queue, &led, portMAX_DELAY) == pdPASS) {
-			/* Set the functionality according the LED mode */
-			switch(led->mode) {
-				case CONTINUOUS_MODE:
-					/* Set and update duty */
-					if(ledc_set_duty(led->ledc_config->speed_mode,
-							led->ledc_config->channel,
-							led->ledc_config->duty) == ESP_OK) {
-
-						ledc_update_duty(led->ledc_config->speed_mode,
-							led->ledc_config->channel);
-					}
-					else {
-						ESP_LOGE(TAG, "Failed to set duty");
-					}
+		return ESP_ERR_INVALID_ARG;
+	}
 
-					break;
+	esp_err_t ret = led_control_start();
 
-				case BLINK_MODE:
-					/* todo: implement */
-					break;
+	if(ret != ESP_OK) {
+		return ret;
+	}
 
-				case FADE_MODE:
-					/* Toggle LED state */
-					led->state = !led->state;
+	led_weights[me->ledc_config->channel] = weight;
 
-					/* Set and start fade functionality */
-					if(ledc_set_fade_with_time(led->ledc_config->speed_mode,
-							led->ledc_config->channel,
-							led->state? 0 : led->ledc_config->duty,
-							led->time) == ESP_OK) {
+#if CONFIG_LED_RESTORE
+	led_persist_save_global();
+#endif
 
-						ledc_fade_start(led->ledc_config->speed_mode,
-								led->ledc_config->channel,
-								LEDC_FADE_NO_WAIT);
-					}
-					else {
-						ESP_LOGE(TAG, "Failed to set fade");
-					}
+	/* Commit the load of the LED again with its new weight */
+	xTaskNotify(led_control_handle, LED_EVENT_COMMAND(me->ledc_config->channel),
+			eSetBits);
 
-					break;
+	return ESP_OK;
+}
 
-				default:
-					ESP_LOGW(TAG, "Unknown LED mode");
+esp_err_t led_layer_clear(led_t * const me, uint8_t layer) {
+	if(me == NULL || me->ledc_config == NULL || layer == 0 ||
+			layer > LED_LAYER_NUM) {
+		ESP_LOGE(TAG, "Error in layer arguments");
 
-					break;
-			}
-		}
+		return ESP_ERR_INVALID_ARG;
 	}
-}
+
+	uint8_t channel = me->ledc_config->channel;
+
+	/* Bump the generation so a pending timeout is ignored */
+	portENTER_CRITICAL(&led_layer_lock);
+
+	led_layers[channel][layer - 1].gen++;
+	led_layer_mask[channel] &= ~(1UL << (layer - 1));
+
+	portEXIT_CRITICAL(&led_layer_lock);
+
+	/* And free its schedule entry */
+	led_sched_cancel(&(led_sched_entry_t){
+			.cmd.led = me,
+			.layer = layer
+	});
+
+	return led_submit(LED_EVENT_COMMAND(channel), false, NULL);
+}
+
+#if CONFIG_LED_LATENCY_STATS
+esp_err_t led_get_latency(led_t * const me, led_latency_t * const latency) {
+	if(me == NULL || me->ledc_config == NULL || latency == NULL) {
+		ESP_LOGE(TAG, "Error in latency arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	*latency = led_latency[me->ledc_config->channel];
+
+	return ESP_OK;
+}
+#endif
+
+#if CONFIG_LED_TRACE
+esp_err_t led_trace_dump(FILE * stream) {
+	if(stream == NULL) {
+		ESP_LOGE(TAG, "Error in trace stream argument");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Only the last LED_TRACE_DEPTH events are still in the buffer */
+	unsigned head = atomic_load_explicit(&led_trace_head, memory_order_acquire);
+	unsigned first = head > LED_TRACE_DEPTH? head - LED_TRACE_DEPTH : 0;
+	unsigned overwritten = first;
+	bool comma = false;
+
+	fprintf(stream, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	/* Name one track per initialized channel, records carry the channel */
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] == NULL) {
+			continue;
+		}
+
+		fprintf(stream, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+				"\"tid\":%u,\"args\":{\"name\":\"LED %u\"}}",
+				comma? "," : "", i, i);
+		comma = true;
+	}
+
+	for(unsigned i = first; i != head; i++) {
+		led_trace_record_t * rec = &led_trace_buf[i & (LED_TRACE_DEPTH - 1)];
+
+		/* Copy the record and discard it if a writer touched it meanwhile */
+		if(atomic_load_explicit(&rec->seq, memory_order_acquire) != i + 1) {
+			overwritten++;
+
+			continue;
+		}
+
+		int64_t ts = rec->ts;
+		uint8_t event = rec->event;
+		uint8_t channel = rec->channel;
+
+		atomic_thread_fence(memory_order_acquire);
+
+		if(atomic_load_explicit(&rec->seq, memory_order_relaxed) != i + 1 ||
+				event >= LED_TRACE_EVENT_NUM) {
+			overwritten++;
+
+			continue;
+		}
+
+		/* Fades are slices, everything else is an instant event */
+		const char * phase = "i\",\"s\":\"t";
+
+		if(event == LED_TRACE_FADE_START) {
+			phase = "B";
+		}
+		else if(event == LED_TRACE_FADE_END) {
+			phase = "E";
+		}
+
+		fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,"
+				"\"pid\":0,\"tid\":%u}",
+				comma? "," : "", led_trace_names[event], phase, (long long)ts,
+				channel);
+		comma = true;
+	}
+
+	fprintf(stream, "],\"otherData\":{\"overwritten\":%u}}\n", overwritten);
+
+	return ESP_OK;
+}
+#endif
+
+esp_err_t led_group_init(led_group_t * const me, led_t * const * leds,
+		const uint32_t * phases, size_t n) {
+	if(me == NULL || leds == NULL || n == 0 || n > LED_MAX_NUM) {
+		ESP_LOGE(TAG, "Error in group arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	memset(me, 0, sizeof(led_group_t));
+
+	/* Phase offsets advance each member on the shared timebase */
+	for(size_t i = 0; i < n; i++) {
+		if(leds[i] == NULL || leds[i]->ledc_config == NULL) {
+			ESP_LOGE(TAG, "Error in group member %u", (unsigned)i);
+
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		uint8_t channel = leds[i]->ledc_config->channel;
+
+		me->members |= 1UL << channel;
+		me->phase[channel] = phases != NULL? phases[i] : 0;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t led_group_set_fade(led_group_t * const me, uint8_t intensity,
+		uint32_t time) {
+	/* Fades need the fade engine and the control task */
+	esp_err_t ret = led_fade_ready();
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	return led_group_submit(me, FADE_MODE, intensity, time);
+}
+
+esp_err_t led_group_set_blink(led_group_t * const me, uint8_t intensity,
+		uint32_t time) {
+	return led_group_submit(me, BLINK_MODE, intensity, time);
+}
+
+esp_err_t led_group_stop(led_group_t * const me) {
+	return led_group_submit(me, CONTINUOUS_MODE, 0, 0);
+}
+
+#if CONFIG_LED_COLOR
+esp_err_t led_color_init(led_color_t * const me, led_t * const red,
+		led_t * const green, led_t * const blue, led_t * const white) {
+	if(me == NULL || red == NULL || green == NULL || blue == NULL) {
+		ESP_LOGE(TAG, "Error in color LED arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	me->leds[0] = red;
+	me->leds[1] = green;
+	me->leds[2] = blue;
+	me->leds[3] = white;
+
+	/* Start without white balance correction */
+	for(uint8_t i = 0; i < 4; i++) {
+		me->gain[i] = 256;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t led_color_set_balance(led_color_t * const me,
+		const uint16_t gain[4]) {
+	if(me == NULL || gain == NULL) {
+		ESP_LOGE(TAG, "Error in color LED arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	memcpy(me->gain, gain, sizeof(me->gain));
+
+	return ESP_OK;
+}
+
+esp_err_t led_color_set_rgb(led_color_t * const me, uint8_t red,
+		uint8_t green, uint8_t blue) {
+	if(me == NULL) {
+		ESP_LOGE(TAG, "Error in color LED arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	return led_color_apply(me, red, green, blue, 100);
+}
+
+esp_err_t led_color_set_hsv(led_color_t * const me, uint16_t hue,
+		uint8_t saturation, uint8_t value) {
+	if(me == NULL || hue >= 360) {
+		ESP_LOGE(TAG, "Error in color LED arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Integer HSV to RGB, one 60 degrees sector at a time */
+	uint32_t rem = (hue % 60) * 255 / 60;
+	uint8_t p = value * (255 - saturation) / 255;
+	uint8_t q = value * (255 - saturation * rem / 255) / 255;
+	uint8_t t = value * (255 - saturation * (255 - rem) / 255) / 255;
+
+	switch(hue / 60) {
+		case 0:
+			return led_color_apply(me, value, t, p, 100);
+
+		case 1:
+			return led_color_apply(me, q, value, p, 100);
+
+		case 2:
+			return led_color_apply(me, p, value, t, 100);
+
+		case 3:
+			return led_color_apply(me, p, q, value, 100);
+
+		case 4:
+			return led_color_apply(me, t, p, value, 100);
+
+		default:
+			return led_color_apply(me, value, p, q, 100);
+	}
+}
+
+esp_err_t led_color_set_temperature(led_color_t * const me, uint16_t kelvin,
+		uint8_t intensity) {
+	if(me == NULL || intensity > 100) {
+		ESP_LOGE(TAG, "Error in color LED arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	kelvin = kelvin < LED_KELVIN_MIN? LED_KELVIN_MIN :
+			kelvin > LED_KELVIN_MAX? LED_KELVIN_MAX : kelvin;
+
+	/* Interpolate the table linearly, the intensity is applied on the duty */
+	uint32_t index = (kelvin - LED_KELVIN_MIN) / LED_KELVIN_STEP;
+	uint32_t frac = (kelvin - LED_KELVIN_MIN) % LED_KELVIN_STEP;
+	const uint8_t * low = led_kelvin_rgb[index];
+	const uint8_t * high = frac? led_kelvin_rgb[index + 1] : low;
+	uint8_t rgb[3];
+
+	for(uint8_t i = 0; i < 3; i++) {
+		rgb[i] = low[i] + ((int32_t)high[i] - low[i]) * (int32_t)frac /
+				LED_KELVIN_STEP;
+	}
+
+	return led_color_apply(me, rgb[0], rgb[1], rgb[2], intensity);
+}
+
+esp_err_t led_set_cct(led_t * const warm, led_t * const cool, uint16_t kelvin,
+		uint8_t intensity, uint32_t time) {
+	if(warm == NULL || warm->ledc_config == NULL || cool == NULL ||
+			cool->ledc_config == NULL || intensity > 100) {
+		ESP_LOGE(TAG, "Error in CCT arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	kelvin = kelvin < LED_CCT_WARM? LED_CCT_WARM :
+			kelvin > LED_CCT_COOL? LED_CCT_COOL : kelvin;
+
+	/* Interpolate the cool share and split the duty, the remainder goes to
+	 * the warm channel so the sum never changes */
+	uint32_t pos = (kelvin - LED_CCT_WARM) * LED_CCT_STEPS;
+	uint32_t index = pos / (LED_CCT_COOL - LED_CCT_WARM);
+	uint32_t frac = pos % (LED_CCT_COOL - LED_CCT_WARM);
+	uint32_t share = led_cct_mix[index];
+
+	if(frac) {
+		share += (led_cct_mix[index + 1] - share) * frac /
+				(LED_CCT_COOL - LED_CCT_WARM);
+	}
+
+	led_cmd_t cmds[2] = {
+			{
+					.led = cool,
+					.mode = time? FADE_MODE : CONTINUOUS_MODE,
+					.time = time
+			},
+			{
+					.led = warm,
+					.mode = time? FADE_MODE : CONTINUOUS_MODE,
+					.time = time
+			}
+	};
+	uint32_t duties[2];
+
+	duties[0] = (intensity * LED_DUTY_INTENSITY * share + LED_DUTY_FULL / 2) /
+			LED_DUTY_FULL;
+	duties[1] = intensity * LED_DUTY_INTENSITY - duties[0];
+
+	/* Latch both duties on the same PWM period */
+	if(!time) {
+		return led_set_many_duty(cmds, duties, 2);
+	}
+
+	/* Fades need the fade engine and the control task */
+	esp_err_t ret = led_fade_ready();
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	/* A one shot ramp to the new duty on each channel, started back to back
+	 * in the same wake-up with the same step timing */
+	for(uint8_t i = 0; i < 2; i++) {
+		led_store(cmds[i].led, FADE_MODE, duties[i], time);
+
+		led_profiles[cmds[i].led->ledc_config->channel] = (led_profile_t){
+				.floor = duties[i],
+				.fall = time,
+				.repeat = 1,
+				.end = duties[i]
+		};
+	}
+
+	return led_submit(LED_EVENT_COMMAND(warm->ledc_config->channel) |
+			LED_EVENT_COMMAND(cool->ledc_config->channel), false, NULL);
+}
+#endif
+
+esp_err_t led_restore_all(void) {
+#if CONFIG_LED_RESTORE
+	uint32_t commands = 0;
+	uint32_t flush = 0;
+
+	/* A restored master dimmer or budget changes every output */
+	bool global = led_persist_load_global();
+
+	/* Reload every LED with a valid record */
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] == NULL) {
+			continue;
+		}
+
+		LED_LOCK(i);
+
+		if(led_persist_load(led_instances[i])) {
+			commands |= LED_EVENT_COMMAND(i);
+		}
+		else if(global && led_group_of[i] == NULL) {
+			flush |= LED_EVENT_COMMAND(i);
+		}
+
+		LED_UNLOCK(i);
+	}
+
+	if(!commands && !global) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	/* Restored states are always applied by the control task */
+	esp_err_t ret = led_control_start();
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	/* The globals already changed, so the other LEDs are flushed even if no
+	 * LED has a record of its own */
+	if(flush) {
+		xTaskNotify(led_control_handle, flush, eSetBits);
+	}
+
+	return commands? led_submit(commands, false, NULL) : ESP_OK;
+#else
+	ESP_LOGE(TAG, "State restore is disabled");
+
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t led_get_brightness(led_t * const me, uint8_t * const intensity) {
+	if(me == NULL || me->ledc_config == NULL || intensity == NULL) {
+		ESP_LOGE(TAG, "Error in brightness arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	uint8_t channel = me->ledc_config->channel;
+	led_ramp_t ramp;
+	unsigned seq;
+
+	/* Copy the ramp without locks, retry if a writer changed it meanwhile */
+	do {
+		seq = atomic_load_explicit(&led_ramp_seq[channel], memory_order_acquire);
+		ramp = led_ramps[channel];
+		atomic_thread_fence(memory_order_acquire);
+	} while((seq & 1) ||
+			seq != atomic_load_explicit(&led_ramp_seq[channel],
+					memory_order_relaxed));
+
+	/* Round the duty to the nearest intensity value */
+	*intensity = (led_ramp_duty(&ramp, esp_timer_get_time()) +
+			LED_DUTY_INTENSITY / 2) / LED_DUTY_INTENSITY;
+
+	return ESP_OK;
+}
+
+esp_err_t led_get_energy(led_t * const me, uint64_t * const energy) {
+	if(me == NULL || me->ledc_config == NULL || energy == NULL) {
+		ESP_LOGE(TAG, "Error in energy arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	uint8_t channel = me->ledc_config->channel;
+	int64_t now = esp_timer_get_time();
+
+	/* Snapshot the accounting, then add the part of the current ramp not
+	 * accounted yet outside the critical section */
+	portENTER_CRITICAL(&led_ramp_lock);
+
+	led_ramp_t ramp = led_ramps[channel];
+	uint64_t area = led_energy[channel];
+	int64_t ts = led_energy_ts[channel];
+
+	portEXIT_CRITICAL(&led_ramp_lock);
+
+	area += led_ramp_area(&ramp, ts, now);
+	*energy = area / LED_DUTY_FULL;
+
+	return ESP_OK;
+}
+
+esp_err_t led_set_energy(led_t * const me, uint64_t energy) {
+	if(me == NULL || me->ledc_config == NULL) {
+		ESP_LOGE(TAG, "Error in energy arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	uint8_t channel = me->ledc_config->channel;
+	int64_t now = esp_timer_get_time();
+
+	/* Restart the accounting from the restored value */
+	portENTER_CRITICAL(&led_ramp_lock);
+
+	led_energy[channel] = energy * LED_DUTY_FULL;
+	led_energy_ts[channel] = now;
+
+	portEXIT_CRITICAL(&led_ramp_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t led_get_stats(led_t * const me, led_stats_t * const stats) {
+	if(stats == NULL || (me != NULL && me->ledc_config == NULL)) {
+		ESP_LOGE(TAG, "Error in stats arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Add up every LED, or only the requested one */
+	uint8_t first = me != NULL? me->ledc_config->channel : 0;
+	uint8_t last = me != NULL? first + 1 : LED_MAX_NUM;
+
+	memset(stats, 0, sizeof(led_stats_t));
+
+	for(uint8_t i = first; i < last; i++) {
+		stats->submitted += atomic_load(&led_counters[i].submitted);
+		stats->applied += atomic_load(&led_counters[i].applied);
+		stats->coalesced += atomic_load(&led_counters[i].coalesced);
+		stats->dropped += atomic_load(&led_counters[i].dropped);
+		stats->fade_ends += atomic_load(&led_counters[i].fade_ends);
+		stats->stale += atomic_load(&led_counters[i].stale);
+		stats->driver_errors += atomic_load(&led_counters[i].driver_errors);
+
+		/* Keep the worst LED for the totals */
+		uint32_t fade_time = atomic_load(&led_counters[i].fade_time);
+		uint32_t fade_error = atomic_load(&led_counters[i].fade_error);
+
+		stats->fade_time_us = fade_time > stats->fade_time_us?
+				fade_time : stats->fade_time_us;
+		stats->fade_error_us = fade_error > stats->fade_error_us?
+				fade_error : stats->fade_error_us;
+	}
+
+	/* The budget is shared by all LEDs */
+	uint32_t load = atomic_load(&led_load);
+
+	stats->load = load;
+	stats->headroom = led_budget > load? led_budget - load : 0;
+
+	memcpy(stats->late, led_sched_late, sizeof(stats->late));
+	stats->wakeups = atomic_load(&led_wakeups);
+	stats->wake_hwm = atomic_load(&led_wake_hwm);
+
+	return ESP_OK;
+}
+
+esp_err_t led_stats_dump(FILE * stream) {
+	if(stream == NULL) {
+		ESP_LOGE(TAG, "Error in stats stream argument");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	led_stats_t stats;
+	bool comma = false;
+
+	/* The totals first, then one object per LED */
+	led_get_stats(NULL, &stats);
+	fprintf(stream, "{\"totals\":");
+	led_stats_json(stream, &stats);
+	fprintf(stream, ",\"leds\":[");
+
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] == NULL) {
+			continue;
+		}
+
+		led_get_stats(led_instances[i], &stats);
+		fprintf(stream, "%s{\"channel\":%u,\"stats\":", comma? "," : "", i);
+		led_stats_json(stream, &stats);
+
+#if CONFIG_LED_LATENCY_STATS
+		const led_latency_t * latency = &led_latency[i];
+
+		fprintf(stream, ",\"latency\":{\"count\":%u,\"max_us\":%u,\"buckets\":[",
+				(unsigned)latency->count, (unsigned)latency->max_us);
+
+		for(uint8_t j = 0; j < LED_LATENCY_BUCKETS; j++) {
+			fprintf(stream, "%s%u", j? "," : "", (unsigned)latency->buckets[j]);
+		}
+
+		fprintf(stream, "]}");
+#endif
+
+		fprintf(stream, "}");
+		comma = true;
+	}
+
+	fprintf(stream, "]}\n");
+
+	return ESP_OK;
+}
+
+/* Private functions ---------------------------------------------------------*/
+static esp_err_t led_setup(led_t * const me, gpio_num_t gpio,
+		uint8_t channel, bool invert, uint32_t * const restored) {
+	/* Error code variable */
+	esp_err_t ret;
+
+	/* Configure and initialize timer for the first instance */
+	if(!led_num) {
+		ledc_timer_config_t leds_timer = {
+				.duty_resolution = LED_DUTY_RESOLUTION,
+				.freq_hz = LED_TIMER_FREQ,
+				.speed_mode = LED_SPEED_MODE,
+				.timer_num = LED_TIMER_NUM,
+				.clk_cfg = LEDC_AUTO_CLK,
+		};
+
+		ret = ledc_timer_config(&leds_timer);
+
+		if(ret != ESP_OK) {
+			ESP_LOGE(TAG, "Failed to configure timer");
+
+			return ret;
+		}
+	}
+
+	/* Allocate memory for led instance */
+	me->ledc_config = malloc(sizeof(ledc_channel_config_t));
+
+	if(me->ledc_config == NULL) {
+		ESP_LOGE(TAG, "Error to allocate memory for LEDC configuration");
+
+		return ESP_ERR_NO_MEM;
+	}
+
+	/* Fill data structure */
+	me->ledc_config->channel = channel;
+	me->ledc_config->duty = 0;
+	me->ledc_config->gpio_num = gpio;
+	me->ledc_config->speed_mode = LED_SPEED_MODE;
+	me->ledc_config->hpoint = 0;
+	me->ledc_config->timer_sel = LED_TIMER_NUM;
+	me->ledc_config->flags.output_invert = invert;
+	me->ledc_config->intr_type = LEDC_INTR_DISABLE;
+
+	/* Initialize other variables */
+	me->time = 0;
+	me->state = 0;
+	me->mode = CONTINUOUS_MODE;
+
+#if CONFIG_LED_RESTORE
+	/* The master dimmer and the power budget scale the first restored output */
+	if(!led_num) {
+		led_persist_load_global();
+	}
+
+	/* Start the channel at its last output instead of dark. The output duty
+	 * seeded by the load is configured, the LED keeps its base duty */
+	if(led_persist_load(me)) {
+		uint32_t duty = me->ledc_config->duty;
+
+		*restored |= LED_EVENT_COMMAND(channel);
+		me->ledc_config->duty = led_ramps[channel].to;
+		ledc_channel_config(me->ledc_config);
+		me->ledc_config->duty = duty;
+	}
+	else {
+		ledc_channel_config(me->ledc_config);
+	}
+#else
+	/* Set LED controller with its configuration */
+	ledc_channel_config(me->ledc_config);
+#endif
+
+#if CONFIG_LED_DIRECT_APPLY
+	/* Create the locks that serialize direct and task writes to the channel */
+	if(led_start_lock == NULL) {
+		led_start_lock = xSemaphoreCreateMutex();
+
+		if(led_start_lock == NULL) {
+			ESP_LOGE(TAG, "Failed to create mutex");
+
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	led_lock[me->ledc_config->channel] = xSemaphoreCreateMutex();
+
+	if(led_lock[me->ledc_config->channel] == NULL) {
+		ESP_LOGE(TAG, "Failed to create mutex");
+
+		return ESP_ERR_NO_MEM;
+	}
+#endif
+
+	/* Increment the LED counter */
+	led_instances[me->ledc_config->channel] = me;
+	led_num++;
+
+#if CONFIG_LED_FADE
+	/* Otherwise the callback is registered with the service by the first fade */
+	if(atomic_load(&led_fade_installed)) {
+		led_fade_register(me);
+	}
+#endif
+
+	return ESP_OK;
+}
+
+static esp_err_t led_start(uint32_t restored) {
+#if CONFIG_LED_RESTORE
+	/* Resume the restored modes, e.g. fades, through the control task */
+	if(restored) {
+		esp_err_t ret = led_control_start();
+
+		if(ret == ESP_OK) {
+			ret = led_submit(restored, false, NULL);
+		}
+
+		return ret;
+	}
+#endif
+
+#if CONFIG_LED_DIRECT_APPLY
+	/* The control task is created by the first fade command */
+	return ESP_OK;
+#else
+	/* Create task to control LEDs */
+	return led_control_start();
+#endif
+}
+
+#if CONFIG_LED_FADE
+static bool fade_end_cb(const ledc_cb_param_t * param, void * arg) {
+    portBASE_TYPE task_awoken = pdFALSE;
+
+    if(param->event == LEDC_FADE_END_EVT) {
+    	LED_TRACE(LED_TRACE_FADE_END, param->channel);
+    	LED_STATS_INC(param->channel, fade_ends);
+
+    	xTaskNotifyFromISR(led_control_handle,
+    			LED_EVENT_FADE_END(param->channel),
+    			eSetBits,
+    			&task_awoken);
+    }
+
+    return (task_awoken == pdTRUE);
+}
+
+static esp_err_t led_fade_install(void) {
+	if(atomic_load(&led_fade_installed)) {
+		return ESP_OK;
+	}
+
+	esp_err_t ret = ledc_fade_func_install(0);
+
+	if(ret != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to install fade service");
+
+		return ret;
+	}
+
+	/* Set the flag before the walk, so an instance added meanwhile is either
+	 * seen here or registers itself in led_setup() */
+	atomic_store(&led_fade_installed, true);
+
+	for(uint8_t i = 0; i < LED_MAX_NUM; i++) {
+		if(led_instances[i] != NULL) {
+			led_fade_register(led_instances[i]);
+		}
+	}
+
+	return ESP_OK;
+}
+
+static void led_fade_register(led_t * const me) {
+	/* Register fade callback */
+	ledc_cbs_t callback = {
+			.fade_cb = fade_end_cb
+	};
+
+	ledc_cb_register(me->ledc_config->speed_mode,
+			me->ledc_config->channel,
+			&callback,
+			(void *)me);
+}
+#endif
+
+static esp_err_t led_set_many_duty(const led_cmd_t * cmds,
+		const uint32_t * duties, size_t n) {
+	uint32_t commands = 0;
+	bool fades = false;
+	esp_err_t ret = ESP_OK;
+
+	/* Validate the whole batch before touching any LED */
+	if(cmds == NULL || n == 0) {
+		ESP_LOGE(TAG, "Error in batch arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	for(size_t i = 0; i < n; i++) {
+		if(!led_cmd_check(&cmds[i])) {
+			ESP_LOGE(TAG, "Error in batch command %u", (unsigned)i);
+
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		fades |= cmds[i].mode == FADE_MODE;
+	}
+
+	/* Fades need the fade engine and the control task */
+	if(fades) {
+		ret = led_fade_ready();
+
+		if(ret != ESP_OK) {
+			return ret;
+		}
+	}
+
+#if CONFIG_LED_DIRECT_APPLY
+	/* Continuous commands never go through the control task */
+	ret = led_apply_direct_many(cmds, duties, n);
+#endif
+
+	for(size_t i = 0; i < n; i++) {
+		led_t * led = cmds[i].led;
+
+#if CONFIG_LED_DIRECT_APPLY
+		if(cmds[i].mode == CONTINUOUS_MODE) {
+			continue;
+		}
+#endif
+
+		/* Internal callers may carry a full resolution duty per command */
+		led_store(led, cmds[i].mode, duties != NULL? duties[i] :
+				cmds[i].intensity * LED_DUTY_INTENSITY,
+				cmds[i].mode == FADE_MODE? cmds[i].time : led->time);
+		commands |= LED_EVENT_COMMAND(led->ledc_config->channel);
+	}
+
+	/* Publish every command with a single notification */
+	if(commands) {
+		esp_err_t err = led_submit(commands, false, NULL);
+
+		if(ret == ESP_OK) {
+			ret = err;
+		}
+	}
+
+	return ret;
+}
+
+static void IRAM_ATTR led_store(led_t * const me, led_mode_e mode,
+		uint32_t duty, uint32_t time) {
+	/* Set mode */
+	if(me->mode != mode) {
+		LED_TRACE(LED_TRACE_MODE_CHANGE, me->ledc_config->channel);
+	}
+
+	me->mode = mode;
+
+	/* The next update starts the new command instead of rescaling the output */
+	atomic_fetch_or_explicit(&led_restart, 1UL << me->ledc_config->channel,
+			memory_order_relaxed);
+
+	/* Set the new duty value */
+	me->ledc_config->duty = duty;
+
+	/* Set new time value, with the same time in both fade directions */
+	me->time = time;
+	led_profiles[me->ledc_config->channel] = (led_profile_t){
+			.fall = time
+	};
+}
+
+static esp_err_t IRAM_ATTR led_submit(uint32_t commands, bool from_isr,
+		BaseType_t * const task_woken) {
+	uint32_t pending;
+
+	for(uint32_t bits = commands; bits; bits &= bits - 1) {
+		LED_STATS_INC(__builtin_ctz(bits), submitted);
+	}
+
+	/* The control task may not exist yet in direct apply mode */
+	if(led_control_handle == NULL) {
+		for(uint32_t bits = commands; bits; bits &= bits - 1) {
+			LED_STATS_INC(__builtin_ctz(bits), dropped);
+		}
+
+		if(!from_isr) {
+			ESP_LOGE(TAG, "Control task not created");
+		}
+
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	for(uint32_t bits = commands; bits; bits &= bits - 1) {
+		LED_LATENCY_STAMP(led_instances[__builtin_ctz(bits)]);
+	}
+
+	/* Flag the LEDs as pending with a single wake-up, the bits never overflow */
+	if(from_isr) {
+		xTaskNotifyAndQueryFromISR(led_control_handle,
+				commands,
+				eSetBits,
+				&pending,
+				task_woken);
+	}
+	else {
+		xTaskNotifyAndQuery(led_control_handle,
+				commands,
+				eSetBits,
+				&pending);
+	}
+
+	/* A command still pending will apply the new state */
+	for(uint32_t bits = commands; bits; bits &= bits - 1) {
+		uint8_t channel = __builtin_ctz(bits);
+
+		if(pending & LED_EVENT_COMMAND(channel)) {
+			LED_STATS_INC(channel, coalesced);
+		}
+		else {
+			LED_TRACE(LED_TRACE_ENQUEUE, channel);
+		}
+	}
+
+	return ESP_OK;
+}
+
+static void led_stats_hwm(unsigned events) {
+	unsigned hwm = atomic_load_explicit(&led_wake_hwm, memory_order_relaxed);
+
+	while(events > hwm &&
+			!atomic_compare_exchange_weak(&led_wake_hwm, &hwm, events)) {
+	}
+}
+
+static void led_control_task(void * arg) {
+	/* Declare pending events, channels to latch and led instance pointer */
+	uint32_t events;
+	uint32_t latch;
+	led_t * led;
+
+	/* Inifinite loop */
+	for(;;) {
+		/* Wait for any LED event and take all of them at once */
+		if(xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY) == pdPASS) {
+			atomic_fetch_add_explicit(&led_wakeups, 1, memory_order_relaxed);
+			led_stats_hwm(__builtin_popcount(events));
+
+#if CONFIG_LED_FADE
+			/* These hardware ramps are over, before anything starts a new one */
+			for(uint32_t ends = (events >> 16) & LED_EVENT_LEDS; ends;
+					ends &= ends - 1) {
+				led_fade_active[__builtin_ctz(ends)] = false;
+			}
+#endif
+
+			/* Turn the scheduled commands that are due into commands */
+			if(events & LED_EVENT_SCHEDULE) {
+				events |= led_sched_run();
+			}
+
+			/* Service every LED with a pending command or fade end */
+			latch = 0;
+
+			for(uint32_t leds = (events | events >> 16) & LED_EVENT_LEDS; leds;
+					leds &= leds - 1) {
+				uint8_t channel = __builtin_ctz(leds);
+
+				led = led_instances[channel];
+
+				LED_TRACE(LED_TRACE_DEQUEUE, channel);
+				LED_LOCK(channel);
+
+				if(events & LED_EVENT_COMMAND(channel)) {
+					/* A command supersedes a fade end of the same LED */
+					latch |= led_update(led);
+				}
+				else if(led_group_of[channel] != NULL) {
+					/* Grouped LEDs are driven by the group timebase */
+				}
+				else if(led_outputs[channel].mode != FADE_MODE) {
+					/* Discard fade ends of LEDs that already left the fade mode */
+					LED_STATS_INC(channel, stale);
+				}
+				else {
+					/* The hardware ramp is over even if the clocks disagree */
+					led_ramp_store(channel, &(led_ramp_t){
+							.from = led_ramps[channel].to,
+							.to = led_ramps[channel].to
+					});
+					led_apply(led, &led_outputs[channel]);
+				}
+
+				LED_UNLOCK(channel);
+			}
+
+			/* Scale the loaded LEDs if the committed load changed the budget
+			 * scale. New continuous duties are only latched below, while fades
+			 * armed above at the old scale are retargeted by this pass */
+			latch |= led_budget_update();
+
+			/* Make every new duty of this wake-up visible at once */
+			led_latch(latch);
+		}
+	}
+}
+
+static esp_err_t led_control_start(void) {
+#if CONFIG_LED_DIRECT_APPLY
+	xSemaphoreTake(led_start_lock, portMAX_DELAY);
+#endif
+
+	/* Create task to control LEDs */
+	if(led_control_handle == NULL) {
+		xTaskCreate(led_control_task,
+				"LED control task",
+				configMINIMAL_STACK_SIZE * 4,
+				NULL,
+				tskIDLE_PRIORITY + 1,
+				&led_control_handle);
+
+		if(led_control_handle == NULL) {
+			ESP_LOGE(TAG, "Failed to create task");
+		}
+	}
+
+	/* Create the timer that wakes the task for scheduled commands */
+	if(led_sched_timer == NULL) {
+		esp_timer_create_args_t timer_args = {
+				.callback = led_sched_cb,
+				.dispatch_method = ESP_TIMER_TASK,
+				.name = "led schedule"
+		};
+
+		if(esp_timer_create(&timer_args, &led_sched_timer) != ESP_OK) {
+			ESP_LOGE(TAG, "Failed to create timer");
+		}
+	}
+
+#if CONFIG_LED_DIRECT_APPLY
+	xSemaphoreGive(led_start_lock);
+#endif
+
+	return led_control_handle != NULL && led_sched_timer != NULL?
+			ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t led_fade_ready(void) {
+#if CONFIG_LED_FADE && CONFIG_LED_DIRECT_APPLY
+	/* Create the control task on the first fade */
+	return led_control_start();
+#elif CONFIG_LED_FADE
+	/* The control task was created by led_init() */
+	return ESP_OK;
+#else
+	ESP_LOGE(TAG, "Fade mode is disabled");
+
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static esp_err_t led_sched_push(const led_sched_entry_t * entry) {
+	size_t from;
+	size_t i;
+
+	portENTER_CRITICAL(&led_sched_lock);
+
+	uint16_t * slot = led_sched_slot(entry);
+
+	if(slot != NULL && *slot) {
+		/* A layer, hold or group has one entry at most, move it in place */
+		from = *slot - 1;
+	}
+	else if(led_sched_num >= LED_SCHED_DEPTH) {
+		portEXIT_CRITICAL(&led_sched_lock);
+
+		if(entry->cmd.led != NULL) {
+			LED_STATS_INC(entry->cmd.led->ledc_config->channel, dropped);
+		}
+
+		ESP_LOGE(TAG, "Schedule is full");
+
+		return ESP_ERR_NO_MEM;
+	}
+	else {
+		from = led_sched_num++;
+	}
+
+	i = led_sched_sift(from, entry);
+
+	portEXIT_CRITICAL(&led_sched_lock);
+
+	/* Let the control task re-arm its timer if the next entry due changed,
+	 * unless it is advancing groups and reads the next entry afterwards */
+	if((i == 0 || from == 0) && !led_sched_busy) {
+		xTaskNotify(led_control_handle, LED_EVENT_SCHEDULE, eSetBits);
+	}
+
+	return ESP_OK;
+}
+
+static void led_sched_cancel(const led_sched_entry_t * entry) {
+	portENTER_CRITICAL(&led_sched_lock);
+
+	uint16_t * slot = led_sched_slot(entry);
+
+	/* Fill the hole with the last entry */
+	if(slot != NULL && *slot) {
+		size_t i = *slot - 1;
+
+		*slot = 0;
+
+		if(i < --led_sched_num) {
+			led_sched_entry_t last = led_sched_heap[led_sched_num];
+
+			led_sched_sift(i, &last);
+		}
+	}
+
+	portEXIT_CRITICAL(&led_sched_lock);
+}
+
+static uint16_t * led_sched_slot(const led_sched_entry_t * entry) {
+	uint8_t channel = entry->cmd.led != NULL?
+			entry->cmd.led->ledc_config->channel : 0;
+
+	if(entry->group) {
+		return &entry->group->slot;
+	}
+
+	if(entry->layer) {
+		return &led_sched_layer_slot[channel][entry->layer - 1];
+	}
+
+	if(entry->hold) {
+		return &led_sched_hold_slot[channel];
+	}
+
+	/* Commands can be scheduled any number of times */
+	return NULL;
+}
+
+static size_t led_sched_sift(size_t i, const led_sched_entry_t * entry) {
+	size_t next;
+
+	/* Move the hole at i up while the parent is due later, then down while a
+	 * child is due earlier, keeping the slots of the moved entries */
+	for(;;) {
+		size_t child = 2 * i + 1;
+
+		if(i > 0 && led_sched_heap[(i - 1) / 2].time > entry->time) {
+			next = (i - 1) / 2;
+		}
+		else if(child < led_sched_num) {
+			if(child + 1 < led_sched_num &&
+					led_sched_heap[child + 1].time < led_sched_heap[child].time) {
+				child++;
+			}
+
+			if(entry->time <= led_sched_heap[child].time) {
+				break;
+			}
+
+			next = child;
+		}
+		else {
+			break;
+		}
+
+		uint16_t * slot = led_sched_slot(&led_sched_heap[next]);
+
+		led_sched_heap[i] = led_sched_heap[next];
+
+		if(slot != NULL) {
+			*slot = i + 1;
+		}
+
+		i = next;
+	}
+
+	uint16_t * slot = led_sched_slot(entry);
+
+	led_sched_heap[i] = *entry;
+
+	if(slot != NULL) {
+		*slot = i + 1;
+	}
+
+	return i;
+}
+
+static void led_sched_cb(void * arg) {
+	xTaskNotify(led_control_handle, LED_EVENT_SCHEDULE, eSetBits);
+}
+
+static uint32_t led_sched_run(void) {
+	uint32_t commands = 0;
+	int64_t now = esp_timer_get_time();
+	int64_t next = -1;
+	led_group_t * groups = NULL;
+
+	portENTER_CRITICAL(&led_sched_lock);
+
+	/* Pop every command, layer timeout and group that is due */
+	while(led_sched_num > 0 && led_sched_heap[0].time <= now) {
+		led_sched_entry_t * entry = &led_sched_heap[0];
+		led_t * led = entry->cmd.led;
+		uint8_t channel = led != NULL? led->ledc_config->channel : 0;
+
+		if(entry->group) {
+			/* Collect the group once, unless it was set again meanwhile */
+			if(entry->group->gen == entry->gen && !entry->group->due) {
+				entry->group->due = true;
+				entry->group->next = groups;
+				groups = entry->group;
+			}
+		}
+		else if(entry->layer) {
+			/* Expire the layer unless it was set again meanwhile */
+			portENTER_CRITICAL(&led_layer_lock);
+
+			if(led_layers[channel][entry->layer - 1].gen == entry->gen) {
+				led_layer_mask[channel] &= ~(1UL << (entry->layer - 1));
+				commands |= LED_EVENT_COMMAND(channel);
+			}
+
+			portEXIT_CRITICAL(&led_layer_lock);
+		}
+		else if(entry->hold) {
+			/* End the hold like a fade end unless a new command came meanwhile */
+			if(led_fades[channel].gen == entry->gen) {
+				commands |= LED_EVENT_FADE_END(channel);
+			}
+		}
+		else {
+			int64_t late = now - entry->time;
+
+			led_sched_late[led_bucket(late < UINT32_MAX? late : UINT32_MAX,
+					LED_LATE_BUCKETS)]++;
+			led_store(led, entry->cmd.mode,
+					entry->cmd.intensity * LED_DUTY_INTENSITY,
+					entry->cmd.mode == FADE_MODE? entry->cmd.time : led->time);
+			commands |= LED_EVENT_COMMAND(channel);
+		}
+
+		/* Free the slot of the entry and sift the last one down from the root */
+		uint16_t * slot = led_sched_slot(entry);
+
+		if(slot != NULL) {
+			*slot = 0;
+		}
+
+		if(--led_sched_num > 0) {
+			led_sched_entry_t last = led_sched_heap[led_sched_num];
+
+			led_sched_sift(0, &last);
+		}
+	}
+
+	led_sched_busy = groups != NULL;
+
+	portEXIT_CRITICAL(&led_sched_lock);
+
+	/* Advance the due groups, each one pushes its next entry */
+	for(; groups != NULL; groups = groups->next) {
+		groups->due = false;
+		commands |= led_group_tick(groups, now);
+	}
+
+	portENTER_CRITICAL(&led_sched_lock);
+
+	led_sched_busy = false;
+
+	if(led_sched_num > 0) {
+		next = led_sched_heap[0].time;
+	}
+
+	portEXIT_CRITICAL(&led_sched_lock);
+
+	/* Sleep until the next command is due */
+	esp_timer_stop(led_sched_timer);
+
+	if(next >= 0) {
+		esp_timer_start_once(led_sched_timer, next > now? next - now : 1);
+	}
+
+	return commands;
+}
+
+#if CONFIG_LED_COLOR
+static esp_err_t led_color_apply(led_color_t * const me, uint8_t red,
+		uint8_t green, uint8_t blue, uint8_t intensity) {
+	uint8_t color[4] = {red, green, blue, 0};
+	led_cmd_t cmds[4];
+	uint32_t duties[4];
+	size_t n = 0;
+
+	/* Move the part common to all colors to the white channel */
+	if(me->leds[3] != NULL) {
+		color[3] = red < green? red : green;
+		color[3] = blue < color[3]? blue : color[3];
+
+		for(uint8_t i = 0; i < 3; i++) {
+			color[i] -= color[3];
+		}
+	}
+
+	/* Apply the white balance and the intensity, scaling straight to the duty
+	 * so dim colors keep every step of the duty resolution */
+	for(uint8_t i = 0; i < 4; i++) {
+		if(me->leds[i] == NULL) {
+			continue;
+		}
+
+		uint32_t c = (color[i] * me->gain[i]) >> 8;
+
+		c = c > 255? 255 : c;
+
+		duties[n] = (c * LED_DUTY_FULL * intensity + 255 * 100 / 2) /
+				(255 * 100);
+		cmds[n++] = (led_cmd_t){
+				.led = me->leds[i],
+				.mode = CONTINUOUS_MODE
+		};
+	}
+
+	/* Latch every channel on the same PWM period so the color never tears */
+	return led_set_many_duty(cmds, duties, n);
+}
+#endif
+
+static esp_err_t led_group_submit(led_group_t * const me, led_mode_e mode,
+		uint8_t intensity, uint32_t time) {
+	if(me == NULL || !me->members || intensity > 100 ||
+			(mode != CONTINUOUS_MODE && time == 0)) {
+		ESP_LOGE(TAG, "Error in group arguments");
+
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	/* Groups are always driven by the control task */
+	esp_err_t ret = led_control_start();
+
+	if(ret != ESP_OK) {
+		return ret;
+	}
+
+	led_sched_entry_t entry = {
+			.time = esp_timer_get_time(),
+			.group = me
+	};
+
+	/* Restart the timebase now, older entries of the group are discarded */
+	portENTER_CRITICAL(&led_group_lock);
+
+	me->mode = mode;
+	me->duty = intensity * LED_DUTY_INTENSITY;
+	me->time = time;
+	me->start = entry.time;
+	entry.gen = ++me->gen;
+
+	portEXIT_CRITICAL(&led_group_lock);
+
+	return led_sched_push(&entry);
+}
+
+static uint32_t led_group_tick(led_group_t * const group, int64_t now) {
+	uint32_t commands = 0;
+	uint32_t latch = 0;
+	int64_t next = INT64_MAX;
+
+	portENTER_CRITICAL(&led_group_lock);
+
+	led_mode_e mode = group->mode;
+	uint32_t peak = group->duty * led_master / 100;
+	uint32_t duty = peak * led_budget_scale >> 8;
+	int64_t segment = (int64_t)group->time * 1000;
+	int64_t start = group->start;
+	uint32_t gen = group->gen;
+
+	portEXIT_CRITICAL(&led_group_lock);
+
+	/* Take the members over with new parameters, or give them back */
+	if(group->applied != gen) {
+		uint32_t members = mode == CONTINUOUS_MODE? 0 : group->members;
+
+		group->applied = gen;
+
+		for(uint32_t bits = group->owned & ~members; bits; bits &= bits - 1) {
+			uint8_t channel = __builtin_ctz(bits);
+
+			LED_LOCK(channel);
+			led_group_of[channel] = NULL;
+			LED_UNLOCK(channel);
+			commands |= LED_EVENT_COMMAND(channel);
+		}
+
+		group->owned = 0;
+
+		for(uint32_t bits = members; bits; bits &= bits - 1) {
+			uint8_t channel = __builtin_ctz(bits);
+
+			if(led_instances[channel] == NULL) {
+				continue;
+			}
+
+			/* Direct writers check the owner of the channel under its lock */
+			LED_LOCK(channel);
+
+			if(led_group_of[channel] != NULL && led_group_of[channel] != group) {
+				led_group_of[channel]->owned &= ~(1UL << channel);
+			}
+
+			/* Force the next command of the LED to be applied */
+			led_group_of[channel] = group;
+			led_outputs[channel].duty = UINT32_MAX;
+			atomic_fetch_or_explicit(&led_restart, 1UL << channel,
+					memory_order_relaxed);
+			group->segment[channel] = UINT32_MAX;
+			group->owned |= 1UL << channel;
+
+			LED_UNLOCK(channel);
+		}
+	}
+
+	/* Start the segment every member is in, ending it on the shared timebase
+	 * so a late wake-up shortens it instead of shifting the members apart */
+	for(uint32_t bits = group->owned; bits; bits &= bits - 1) {
+		uint8_t channel = __builtin_ctz(bits);
+		led_t * led = led_instances[channel];
+		int64_t origin = start - (int64_t)group->phase[channel] * 1000;
+		int64_t index = (now - origin) / segment;
+		int64_t end = origin + (index + 1) * segment;
+
+		next = end < next? end : next;
+
+		led_budget_commit(channel, peak);
+
+		LED_LOCK(channel);
+
+		/* Even segments go up or on, odd segments down or off */
+		if(group->segment[channel] != (uint32_t)index) {
+			group->segment[channel] = index;
+			latch |= led_group_step(led, mode, index & 1? 0 : duty, end, now);
+		}
+
+		LED_UNLOCK(channel);
+	}
+
+	/* Blink edges of all members are made visible together */
+	led_latch(latch);
+
+	/* One schedule entry per group, due at the next segment end of any member */
+	if(group->owned) {
+		led_sched_entry_t entry = {
+				.time = next,
+				.group = group,
+				.gen = gen
+		};
+
+		/* Without a next edge the group would freeze, so give the members
+		 * back to their own commands until the group is set again */
+		if(led_sched_push(&entry) != ESP_OK) {
+			for(uint32_t bits = group->owned; bits; bits &= bits - 1) {
+				uint8_t channel = __builtin_ctz(bits);
+
+				LED_LOCK(channel);
+				led_group_of[channel] = NULL;
+				LED_UNLOCK(channel);
+				commands |= LED_EVENT_COMMAND(channel);
+			}
+
+			group->owned = 0;
+		}
+	}
+
+	return commands;
+}
+
+static uint32_t led_group_step(led_t * const led, led_mode_e mode,
+		uint32_t target, int64_t end, int64_t now) {
+	uint8_t channel = led->ledc_config->channel;
+
+#if CONFIG_LED_FADE
+	if(mode == FADE_MODE) {
+		uint32_t from = led_ramp_duty(&led_ramps[channel], now);
+
+		if(from != target) {
+			led->state = target < from;
+			led_fade_ramp(led, from, target, (end - now + 999) / 1000, now);
+		}
+
+		return 0;
+	}
+
+	led_fade_stop(led);
+#endif
+
+	led_ramp_store(channel, &(led_ramp_t){
+			.from = target,
+			.to = target
+	});
+
+	/* Set duty, the edges of all members are latched together */
+	if(ledc_set_duty(led->ledc_config->speed_mode, channel, target) != ESP_OK) {
+		LED_STATS_INC(channel, driver_errors);
+		ESP_LOGE(TAG, "Failed to set duty");
+
+		return 0;
+	}
+
+	return 1UL << channel;
+}
+
+#if CONFIG_LED_DIRECT_APPLY
+static esp_err_t led_apply_direct_many(const led_cmd_t * cmds,
+		const uint32_t * duties, size_t n) {
+	uint32_t channels = 0;
+	esp_err_t ret = ESP_OK;
+
+	for(size_t i = 0; i < n; i++) {
+		if(cmds[i].mode == CONTINUOUS_MODE) {
+			channels |= 1UL << cmds[i].led->ledc_config->channel;
+		}
+	}
+
+	/* Take the locks in channel order so batches never deadlock */
+	uint32_t locked = channels;
+
+	for(uint32_t bits = locked; bits; bits &= bits - 1) {
+		LED_LOCK(__builtin_ctz(bits));
+	}
+
+	/* Stage every duty first */
+	for(size_t i = 0; i < n; i++) {
+		led_t * led = cmds[i].led;
+		esp_err_t err = ESP_OK;
+
+		if(cmds[i].mode != CONTINUOUS_MODE) {
+			continue;
+		}
+
+		uint8_t channel = led->ledc_config->channel;
+
+		LED_STATS_INC(channel, submitted);
+		LED_LATENCY_STAMP(led);
+		led_store(led, CONTINUOUS_MODE, duties != NULL? duties[i] :
+				cmds[i].intensity * LED_DUTY_INTENSITY, led->time);
+
+#if CONFIG_LED_RESTORE
+		led_persist_save(led);
+#endif
+
+		/* Active layers are composited, groups left and the power budget
+		 * enforced by the control task, which counts the output it applies */
+		if(led_layer_mask[channel] || led_group_of[channel] != NULL ||
+				led_budget) {
+			xTaskNotify(led_control_handle, LED_EVENT_COMMAND(channel), eSetBits);
+			channels &= ~(1UL << channel);
+
+			continue;
+		}
+
+#if CONFIG_LED_FADE
+		/* A running fade would hold the channel until its current ramp ends */
+		err = led_fade_stop(led);
+#endif
+
+		led_outputs[channel].mode = CONTINUOUS_MODE;
+		led_outputs[channel].duty = led->ledc_config->duty * led_master / 100;
+		led_ramp_store(channel, &(led_ramp_t){
+				.from = led_outputs[channel].duty,
+				.to = led_outputs[channel].duty
+		});
+
+		if(err == ESP_OK) {
+			LED_LATENCY_RECORD(led);
+
+			err = ledc_set_duty(led->ledc_config->speed_mode,
+					channel,
+					led_outputs[channel].duty);
+		}
+
+		if(err != ESP_OK) {
+			LED_STATS_INC(channel, driver_errors);
+			ESP_LOGE(TAG, "Failed to set duty");
+			channels &= ~(1UL << channel);
+			ret = err;
+		}
+		else {
+			LED_STATS_INC(channel, applied);
+		}
+	}
+
+	/* Then latch them together */
+	led_latch(channels);
+
+	for(uint32_t bits = locked; bits; bits &= bits - 1) {
+		LED_UNLOCK(__builtin_ctz(bits));
+	}
+
+	return ret;
+}
+#endif
+
+static uint32_t led_update(led_t * const led) {
+	uint8_t channel = led->ledc_config->channel;
+	led_output_t out;
+#if CONFIG_LED_FADE
+	bool restart = atomic_fetch_and_explicit(&led_restart, ~(1UL << channel),
+			memory_order_relaxed) & (1UL << channel);
+#endif
+
+	/* A command takes the LED out of its group */
+	if(led_group_of[channel] != NULL) {
+		led_group_of[channel]->owned &= ~(1UL << channel);
+		led_group_of[channel] = NULL;
+	}
+
+#if CONFIG_LED_RESTORE
+	led_persist_save(led);
+#endif
+
+	/* Blend the active layers over the led_set_* base layer */
+	portENTER_CRITICAL(&led_layer_lock);
+	led_compose(led, &out);
+	portEXIT_CRITICAL(&led_layer_lock);
+
+	/* Scale by the master dimmer only when converting to the output duty */
+	out.duty = out.duty * led_master / 100;
+	out.profile.floor = out.profile.floor * led_master / 100;
+	out.profile.end = out.profile.end * led_master / 100;
+
+	/* Commit the peak load of the output, then fit it to the power budget */
+	led_budget_commit(channel, out.mode == FADE_MODE &&
+			out.profile.end > out.duty? out.profile.end : out.duty);
+
+#if CONFIG_LED_FADE
+	/* Once the profile is finished only its end level is left loaded */
+	led_fade_ends[channel] = out.profile.end;
+#endif
+
+	out.duty = out.duty * led_budget_scale >> 8;
+	out.profile.floor = out.profile.floor * led_budget_scale >> 8;
+	out.profile.end = out.profile.end * led_budget_scale >> 8;
+
+	/* Leave the output alone if nothing visible changed */
+	bool same = out.mode == led_outputs[channel].mode &&
+			out.time == led_outputs[channel].time &&
+			!memcmp(&out.profile, &led_outputs[channel].profile,
+					sizeof(led_profile_t));
+
+	if(same && out.duty == led_outputs[channel].duty) {
+		LED_LATENCY_RECORD(led);
+
+		return 0;
+	}
+
+#if CONFIG_LED_FADE
+	/* The master dimmer, the budget or a layer going away only change the
+	 * levels of a running fade. Rescale its current step instead of
+	 * restarting it, so a finite profile never replays its cycles */
+	const led_profile_t * prev = &led_outputs[channel].profile;
+
+	if(!restart && out.mode == FADE_MODE &&
+			out.mode == led_outputs[channel].mode &&
+			out.time == led_outputs[channel].time &&
+			out.profile.fall == prev->fall &&
+			out.profile.hold_high == prev->hold_high &&
+			out.profile.hold_low == prev->hold_low &&
+			out.profile.repeat == prev->repeat) {
+		led_outputs[channel] = out;
+		LED_LATENCY_RECORD(led);
+		led_fade_rescale(led, &led_outputs[channel], esp_timer_get_time());
+
+		return 0;
+	}
+#endif
+
+	led_outputs[channel] = out;
+
+	/* A new command restarts the fade profile with a ramp to its level */
+	led_fades[channel].next = LED_FADE_RISE;
+	led_fades[channel].left = out.profile.repeat;
+	led_fades[channel].gen++;
+
+	/* Without a ramp or a hold to run, a finite profile only has to end */
+	if(out.duty == out.profile.floor && !out.profile.hold_high &&
+			!out.profile.hold_low && led_fades[channel].left) {
+		led_fades[channel].left = 1;
+	}
+
+	/* Only outputs that reach the peripheral are counted as applied */
+	LED_STATS_INC(channel, applied);
+
+	return led_apply(led, &led_outputs[channel]);
+}
+
+static void led_compose(led_t * const led, led_output_t * const out) {
+	uint8_t channel = led->ledc_config->channel;
+	uint32_t mask = led_layer_mask[channel];
+
+	/* An opaque top layer hides everything below it */
+	if(mask) {
+		const led_layer_t * top = &led_layers[channel][31 - __builtin_clz(mask)];
+
+		if(top->blend == LED_BLEND_OVER && !top->transparency) {
+			*out = top->output;
+
+			return;
+		}
+	}
+
+	/* Start from the base layer and blend the active layers bottom to top */
+	out->mode = led->mode;
+	out->duty = led->ledc_config->duty;
+	out->time = led->time;
+	out->profile = led_profiles[channel];
+
+	for(; mask; mask &= mask - 1) {
+		const led_layer_t * l = &led_layers[channel][__builtin_ctz(mask)];
+		int32_t below = out->duty;
+		int32_t level = l->output.duty;
+
+		switch(l->blend) {
+			case LED_BLEND_MAX:
+				level = level > below? level : below;
+				break;
+
+			case LED_BLEND_ADD:
+				level = level + below < LED_DUTY_FULL? level + below : LED_DUTY_FULL;
+				break;
+
+			case LED_BLEND_MULTIPLY:
+				level = level * below / LED_DUTY_FULL;
+				break;
+
+			default:
+				/* Only alpha-over layers take over the mode and fade profile */
+				out->mode = l->output.mode;
+				out->time = l->output.time;
+				out->profile = l->output.profile;
+				break;
+		}
+
+		/* Mix the result with the layer below in 8-bit fixed point */
+		out->duty = below + (((level - below) * (256 - l->transparency)) >> 8);
+	}
+}
+
+static uint32_t led_apply(led_t * const led, const led_output_t * out) {
+	uint8_t channel = led->ledc_config->channel;
+#if CONFIG_LED_FADE
+	const led_ramp_t * ramp = &led_ramps[channel];
+	int64_t now = esp_timer_get_time();
+	uint32_t duty = led_ramp_duty(ramp, now);
+#endif
+	uint32_t latch = 0;
+
+	/* Set the functionality according the LED mode */
+	switch(out->mode) {
+		case CONTINUOUS_MODE:
+#if CONFIG_LED_FADE
+			/* Stop a running ramp so it does not override the new duty */
+			led_fade_stop(led);
+#endif
+
+			led_ramp_store(channel, &(led_ramp_t){
+					.from = out->duty,
+					.to = out->duty
+			});
+
+			/* Set duty, it is updated later by led_latch() */
+			LED_LATENCY_RECORD(led);
+
+			if(ledc_set_duty(led->ledc_config->speed_mode,
+					led->ledc_config->channel,
+					out->duty) == ESP_OK) {
+
+				latch = 1UL << led->ledc_config->channel;
+			}
+			else {
+				LED_STATS_INC(led->ledc_config->channel, driver_errors);
+				ESP_LOGE(TAG, "Failed to set duty");
+			}
+
+			break;
+
+		case BLINK_MODE:
+			/* todo: implement */
+			break;
+
+#if CONFIG_LED_FADE
+		case FADE_MODE:
+			/* Run the next step of the fade profile */
+			LED_LATENCY_RECORD(led);
+			led_fade_next(led, out, duty, now);
+
+			break;
+#endif
+
+		default:
+			ESP_LOGW(TAG, "Unknown LED mode");
+
+			break;
+	}
+
+	return latch;
+}
+
+#if CONFIG_LED_FADE
+static void led_fade_next(led_t * const led, const led_output_t * out,
+		uint32_t duty, int64_t now) {
+	led_fade_t * fade = &led_fades[led->ledc_config->channel];
+	const led_profile_t * profile = &out->profile;
+	uint32_t span = out->duty > profile->floor? out->duty - profile->floor : 0;
+
+	/* Run steps until a ramp or a hold has to wait, a whole cycle without
+	 * either means there is nothing left to animate */
+	for(uint8_t steps = 0; steps <= LED_FADE_FINISH; steps++) {
+		led_fade_step_e step = fade->next;
+		uint32_t target;
+		uint32_t time;
+		uint32_t hold;
+
+		switch(step) {
+			case LED_FADE_RISE:
+				target = out->duty;
+				time = out->time;
+				fade->next = LED_FADE_HOLD_HIGH;
+
+				break;
+
+			case LED_FADE_FALL:
+				target = profile->floor;
+				time = profile->fall;
+				fade->next = LED_FADE_HOLD_LOW;
+
+				break;
+
+			case LED_FADE_FINISH:
+				target = profile->end;
+				time = profile->end > duty? out->time : profile->fall;
+				fade->next = LED_FADE_DONE;
+
+				/* The peak of the cycles is not reached anymore */
+				led_budget_commit(led->ledc_config->channel,
+						led_fade_ends[led->ledc_config->channel]);
+
+				break;
+
+			case LED_FADE_HOLD_LOW:
+				/* A cycle ends at the floor, finish it after the last one */
+				if(fade->left && !--fade->left) {
+					fade->next = LED_FADE_FINISH;
+
+					continue;
+				}
+
+				/* fall through */
+			case LED_FADE_HOLD_HIGH:
+				hold = step == LED_FADE_HOLD_HIGH?
+						profile->hold_high : profile->hold_low;
+				fade->next = step == LED_FADE_HOLD_HIGH?
+						LED_FADE_FALL : LED_FADE_RISE;
+
+				/* Wait in the scheduler, the hold ends like a fade end */
+				if(hold) {
+					led_sched_entry_t entry = {
+							.time = now + hold,
+							.cmd.led = led,
+							.hold = true,
+							.gen = fade->gen
+					};
+
+					if(led_sched_push(&entry) == ESP_OK) {
+						return;
+					}
+				}
+
+				continue;
+
+			default:
+				return;
+		}
+
+		/* Skip ramps that are already at their end */
+		uint32_t delta = duty > target? duty - target : target - duty;
+
+		if(!delta) {
+			continue;
+		}
+
+		/* Keep the slew rate of a full ramp when starting from elsewhere */
+		if(span) {
+			time = (uint64_t)time * delta / span;
+		}
+
+		led->state = target < duty;
+		led_fade_ramp(led, duty, target, time? time : 1, now);
+
+		return;
+	}
+
+	fade->next = LED_FADE_DONE;
+}
+
+static void led_fade_rescale(led_t * const led, const led_output_t * out,
+		int64_t now) {
+	uint8_t channel = led->ledc_config->channel;
+	led_fade_t * fade = &led_fades[channel];
+
+	/* Run the step in progress again towards its new target, a hold keeps
+	 * its level until the next ramp and a finished profile goes to its end */
+	switch(fade->next) {
+		case LED_FADE_HOLD_HIGH:
+			fade->next = LED_FADE_RISE;
+			break;
+
+		case LED_FADE_HOLD_LOW:
+			fade->next = LED_FADE_FALL;
+			break;
+
+		case LED_FADE_DONE:
+			fade->next = LED_FADE_FINISH;
+			break;
+
+		default:
+			return;
+	}
+
+	/* The old ramp must not end the step, even if no new ramp is needed */
+	led_fade_stop(led);
+	LED_STATS_INC(channel, applied);
+	led_fade_next(led, out, led_ramp_duty(&led_ramps[channel], now), now);
+}
+
+static void led_fade_ramp(led_t * const led, uint32_t from, uint32_t to,
+		uint32_t time, int64_t now) {
+	uint8_t channel = led->ledc_config->channel;
+
+	/* The fade service is installed by the first ramp, from the control task */
+	if(led_fade_install() != ESP_OK) {
+		LED_STATS_INC(channel, driver_errors);
+
+		return;
+	}
+
+	/* Re-arming a running fade would block until it ends, and its fade end
+	 * would be taken for the end of the new ramp */
+	if(led_fade_stop(led) != ESP_OK) {
+		LED_STATS_INC(channel, driver_errors);
+	}
+
+	const led_step_t * steps = led_fade_steps(from > to? from - to : to - from,
+			time);
+	uint32_t error = steps->achieved > time * 1000?
+			steps->achieved - time * 1000 : time * 1000 - steps->achieved;
+
+	atomic_store_explicit(&led_counters[channel].fade_time, steps->achieved,
+			memory_order_relaxed);
+
+	if(error > atomic_load_explicit(&led_counters[channel].fade_error,
+			memory_order_relaxed)) {
+		atomic_store_explicit(&led_counters[channel].fade_error, error,
+				memory_order_relaxed);
+	}
+
+	led_ramp_store(channel, &(led_ramp_t){
+			.from = from,
+			.to = to,
+			.start = now,
+			.duration = steps->achieved
+	});
+
+	/* Set and start fade functionality with the precomputed steps */
+	if(ledc_set_fade_with_step(led->ledc_config->speed_mode,
+			channel,
+			to,
+			steps->scale,
+			steps->cycles) == ESP_OK) {
+
+		ledc_fade_start(led->ledc_config->speed_mode,
+				channel,
+				LEDC_FADE_NO_WAIT);
+
+		led_fade_active[channel] = true;
+		LED_TRACE(LED_TRACE_FADE_START, channel);
+	}
+	else {
+		LED_STATS_INC(channel, driver_errors);
+		ESP_LOGE(TAG, "Failed to set fade");
+	}
+}
+
+static esp_err_t led_fade_stop(led_t * const led) {
+	uint8_t channel = led->ledc_config->channel;
+
+	if(!led_fade_active[channel]) {
+		return ESP_OK;
+	}
+
+	led_fade_active[channel] = false;
+
+	esp_err_t ret = ledc_fade_stop(led->ledc_config->speed_mode, channel);
+
+	/* Drop a fade end the stopped ramp may have raised meanwhile, or close
+	 * its trace slice if it had not ended yet */
+	if(!(ulTaskNotifyValueClear(led_control_handle,
+			LED_EVENT_FADE_END(channel)) & LED_EVENT_FADE_END(channel))) {
+		LED_TRACE(LED_TRACE_FADE_END, channel);
+	}
+
+	return ret;
+}
+
+static const led_step_t * led_fade_steps(uint32_t delta, uint32_t time) {
+	led_step_t * entry = &led_step_cache[(delta * 31 + time) %
+			LED_STEP_CACHE_NUM];
+
+	if(entry->scale && entry->delta == delta && entry->time == time) {
+		return entry;
+	}
+
+	/* PWM periods the fade has to last */
+	uint64_t periods = ((uint64_t)time * LED_TIMER_FREQ + 500) / 1000;
+	uint64_t best = UINT64_MAX;
+
+	entry->delta = delta;
+	entry->time = time;
+
+	/* Take the finest duty step whose step number times the cycles per step
+	 * gets closest to the requested periods, the driver sets the remainder of
+	 * the delta at the end of the fade */
+	for(uint32_t scale = (delta + LED_STEP_MAX - 1) / LED_STEP_MAX;
+			scale <= delta && scale <= LED_STEP_MAX && best; scale++) {
+		uint32_t num = delta / scale;
+		uint64_t cycles = (periods + num / 2) / num;
+
+		cycles = cycles < 1? 1 : cycles > LED_STEP_MAX? LED_STEP_MAX : cycles;
+
+		uint64_t error = num * cycles > periods?
+				num * cycles - periods : periods - num * cycles;
+
+		if(error < best) {
+			best = error;
+			entry->scale = scale;
+			entry->cycles = cycles;
+			entry->achieved = (uint64_t)num * cycles * 1000000 / LED_TIMER_FREQ;
+		}
+	}
+
+	return entry;
+}
+#endif
+
+static void led_latch(uint32_t channels) {
+	if(!channels) {
+		return;
+	}
+
+	/* Trigger the staged duties back to back with interrupts masked, so all
+	 * channels of the shared timer take them on the same PWM period */
+	portENTER_CRITICAL(&led_latch_lock);
+
+	for(uint32_t bits = channels; bits; bits &= bits - 1) {
+		ledc_update_duty(LED_SPEED_MODE, __builtin_ctz(bits));
+	}
+
+	portEXIT_CRITICAL(&led_latch_lock);
+}
+
+static void led_budget_commit(uint8_t channel, uint32_t peak) {
+	uint32_t load = peak * led_weights[channel] / LED_DUTY_FULL;
+
+	/* Only the difference with the previous load of the LED is added */
+	atomic_fetch_add_explicit(&led_load, load - led_loads[channel],
+			memory_order_relaxed);
+	led_loads[channel] = load;
+}
+
+static uint32_t led_budget_update(void) {
+	uint32_t load = atomic_load_explicit(&led_load, memory_order_relaxed);
+	uint32_t scale = led_budget && load > led_budget?
+			((uint64_t)led_budget << 8) / load : 256;
+	uint32_t latch = 0;
+
+	if(scale == led_budget_scale) {
+		return 0;
+	}
+
+	led_budget_scale = scale;
+
+#if CONFIG_LED_RESTORE
+	led_persist_save_global();
+#endif
+
+	/* Scale every loaded LED down or back up proportionally */
+	for(uint8_t channel = 0; channel < LED_MAX_NUM; channel++) {
+		if(!led_loads[channel] || led_instances[channel] == NULL ||
+				led_group_of[channel] != NULL) {
+			continue;
+		}
+
+		LED_LOCK(channel);
+		latch |= led_update(led_instances[channel]);
+		LED_UNLOCK(channel);
+	}
+
+	return latch;
+}
+
+static uint32_t led_ramp_duty(const led_ramp_t * ramp, int64_t now) {
+	int64_t elapsed = now - ramp->start;
+
+	if(elapsed >= ramp->duration) {
+		return ramp->to;
+	}
+
+	/* Linear interpolation, as done by the LEDC fade hardware */
+	return ramp->from + (ramp->slope * elapsed >> 32);
+}
+
+static void led_ramp_store(uint8_t channel, const led_ramp_t * ramp) {
+	led_ramp_t next = *ramp;
+	int64_t now = esp_timer_get_time();
+
+	/* Divide once per ramp here, so readers and the critical section below
+	 * only multiply and shift */
+	next.slope = next.duration?
+			((int64_t)next.to - next.from) * ((int64_t)1 << 32) / next.duration : 0;
+
+	/* The critical section serializes writers and keeps a reader on the same
+	 * core from preempting a half written ramp, so led_get_brightness() never
+	 * spins for long */
+	portENTER_CRITICAL(&led_ramp_lock);
+
+	unsigned seq = atomic_load_explicit(&led_ramp_seq[channel],
+			memory_order_relaxed);
+
+	/* Integrate the duty of the ramp being replaced up to now */
+	led_energy[channel] += led_ramp_area(&led_ramps[channel],
+			led_energy_ts[channel], now);
+	led_energy_ts[channel] = now;
+
+	atomic_store_explicit(&led_ramp_seq[channel], seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	led_ramps[channel] = next;
+	atomic_store_explicit(&led_ramp_seq[channel], seq + 2, memory_order_release);
+
+	portEXIT_CRITICAL(&led_ramp_lock);
+}
+
+static uint64_t led_ramp_area(const led_ramp_t * ramp, int64_t from,
+		int64_t to) {
+	int64_t end = ramp->start + ramp->duration;
+	uint64_t area = 0;
+
+	if(to <= from) {
+		return 0;
+	}
+
+	/* Trapezoid over the part of the ramp still running */
+	if(from < end) {
+		int64_t stop = to < end? to : end;
+
+		area = (uint64_t)(led_ramp_duty(ramp, from) + led_ramp_duty(ramp, stop)) *
+				(stop - from) >> 1;
+		from = stop;
+	}
+
+	/* Constant level after the ramp */
+	return area + (uint64_t)ramp->to * (to - from);
+}
+
+static uint32_t led_bucket(uint32_t value, uint32_t buckets) {
+	/* Bucket n holds values below 2^n, the last one everything above */
+	uint32_t bucket = value? 32 - __builtin_clz(value) : 0;
+
+	return bucket < buckets? bucket : buckets - 1;
+}
+
+static bool led_cmd_check(const led_cmd_t * cmd) {
+	return cmd->led != NULL && cmd->led->ledc_config != NULL &&
+			cmd->intensity <= 100 &&
+			(cmd->mode == CONTINUOUS_MODE || cmd->mode == FADE_MODE);
+}
+
+static void led_stats_json(FILE * stream, const led_stats_t * stats) {
+	fprintf(stream, "{\"submitted\":%u,\"applied\":%u,\"coalesced\":%u,"
+			"\"dropped\":%u,\"fade_ends\":%u,\"stale\":%u,\"driver_errors\":%u,"
+			"\"wakeups\":%u,\"wake_hwm\":%u,\"fade_time_us\":%u,"
+			"\"fade_error_us\":%u,\"load\":%u,\"headroom\":%u,\"late\":[",
+			(unsigned)stats->submitted, (unsigned)stats->applied,
+			(unsigned)stats->coalesced, (unsigned)stats->dropped,
+			(unsigned)stats->fade_ends, (unsigned)stats->stale,
+			(unsigned)stats->driver_errors, (unsigned)stats->wakeups,
+			(unsigned)stats->wake_hwm, (unsigned)stats->fade_time_us,
+			(unsigned)stats->fade_error_us, (unsigned)stats->load,
+			(unsigned)stats->headroom);
+
+	for(uint8_t i = 0; i < LED_LATE_BUCKETS; i++) {
+		fprintf(stream, "%s%u", i? "," : "", (unsigned)stats->late[i]);
+	}
+
+	fprintf(stream, "]}");
+}
+
+#if CONFIG_LED_RESTORE
+static void led_persist_save(led_t * const me) {
+	led_persist_t * rec = &led_persist[me->ledc_config->channel];
+
+	rec->magic = LED_PERSIST_MAGIC;
+	rec->mode = me->mode;
+	rec->duty = me->ledc_config->duty;
+	rec->time = me->time;
+	rec->profile = led_profiles[me->ledc_config->channel];
+	rec->crc = esp_rom_crc32_le(0, (const uint8_t *)rec,
+			offsetof(led_persist_t, crc));
+}
+
+static bool led_persist_load(led_t * const me) {
+	const led_persist_t * rec = &led_persist[me->ledc_config->channel];
+
+	/* RTC memory only survives deep sleep and soft resets */
+	if(esp_reset_reason() == ESP_RST_POWERON || rec->magic != LED_PERSIST_MAGIC ||
+			rec->crc != esp_rom_crc32_le(0, (const uint8_t *)rec,
+					offsetof(led_persist_t, crc)) ||
+			rec->duty > LED_DUTY_FULL ||
+			(rec->mode != CONTINUOUS_MODE &&
+					(!LED_FADE_ENABLED || rec->mode != FADE_MODE))) {
+		return false;
+	}
+
+	me->mode = rec->mode;
+	me->ledc_config->duty = rec->duty;
+	atomic_fetch_or_explicit(&led_restart, 1UL << me->ledc_config->channel,
+			memory_order_relaxed);
+	me->time = rec->time;
+	led_profiles[me->ledc_config->channel] = rec->profile;
+
+	/* Seed the output with the base duty scaled like the control task does,
+	 * so led_get_brightness() is right before the control task applies it */
+	uint32_t duty = rec->duty * led_master / 100 * led_budget_scale >> 8;
+
+	led_ramp_store(me->ledc_config->channel, &(led_ramp_t){
+			.from = duty,
+			.to = duty
+	});
+
+	return true;
+}
+
+static void led_persist_save_global(void) {
+	led_persist_global_t * rec = &led_persist_global;
+
+	/* Saved by both the application and the control task */
+	portENTER_CRITICAL(&led_persist_lock);
+
+	rec->magic = LED_PERSIST_MAGIC;
+	rec->master = led_master;
+	rec->budget = led_budget;
+	rec->budget_scale = led_budget_scale;
+	memcpy(rec->weights, led_weights, sizeof(rec->weights));
+	rec->crc = esp_rom_crc32_le(0, (const uint8_t *)rec,
+			offsetof(led_persist_global_t, crc));
+
+	portEXIT_CRITICAL(&led_persist_lock);
+}
+
+static bool led_persist_load_global(void) {
+	const led_persist_global_t * rec = &led_persist_global;
+
+	if(esp_reset_reason() == ESP_RST_POWERON || rec->magic != LED_PERSIST_MAGIC ||
+			rec->crc != esp_rom_crc32_le(0, (const uint8_t *)rec,
+					offsetof(led_persist_global_t, crc)) ||
+			rec->master > 100 || rec->budget_scale > 256) {
+		return false;
+	}
+
+	led_master = rec->master;
+	led_budget = rec->budget;
+	led_budget_scale = rec->budget_scale;
+	memcpy(led_weights, rec->weights, sizeof(led_weights));
+
+	return true;
+}
+#endif
+
+#if CONFIG_LED_LATENCY_STATS
+static uint32_t IRAM_ATTR led_latency_now(void) {
+	/* The cycle counter is per core, while the stamp and the record can run on
+	 * different cores, so use the system timer shared by both */
+	return (uint32_t)esp_timer_get_time();
+}
+
+static void IRAM_ATTR led_latency_stamp(led_t * const me) {
+	/* Zero is reserved to flag that no command is pending */
+	led_latency_ts[me->ledc_config->channel] = led_latency_now() | 1;
+}
+
+static void led_latency_record(led_t * const me) {
+	uint32_t channel = me->ledc_config->channel;
+	uint32_t ts = led_latency_ts[channel];
+
+	/* Fade reversals are not commands, so they are never stamped */
+	if(!ts) {
+		return;
+	}
+
+	led_latency_ts[channel] = 0;
+
+	/* Both stamps are in microseconds, the subtraction wraps correctly */
+	uint32_t elapsed = led_latency_now() - ts;
+
+	/* Update the log2 histogram */
+	led_latency[channel].buckets[led_bucket(elapsed, LED_LATENCY_BUCKETS)]++;
+	led_latency[channel].count++;
+
+	if(elapsed > led_latency[channel].max_us) {
+		led_latency[channel].max_us = elapsed;
+	}
+}
+#endif
+
+#if CONFIG_LED_TRACE
+static void IRAM_ATTR led_trace(led_trace_event_e event, uint32_t channel) {
+	/* Claim a slot, lapping the oldest event when the buffer is full */
+	unsigned i = atomic_fetch_add_explicit(&led_trace_head, 1,
+			memory_order_relaxed);
+	led_trace_record_t * rec = &led_trace_buf[i & (LED_TRACE_DEPTH - 1)];
+
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	rec->ts = esp_timer_get_time();
+	rec->event = event;
+	rec->channel = channel;
+
+	/* Publish the record */
+	atomic_store_explicit(&rec->seq, i + 1, memory_order_release);
+}
+#endif
 
 /***************************** END OF FILE ************************************/